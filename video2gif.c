@@ -16,8 +16,12 @@
 //////////////////////////////////////////////////////////////////////////////
 
 #include <io.h>
+#include <direct.h>
+#include <sys/stat.h>
 #include <tchar.h>
 #include <string.h>
+#include <stddef.h>
+#include <math.h>
 #include <Windows.h>
 #include <pthread.h>
 #include <libavformat/avformat.h>
@@ -26,12 +30,37 @@
 #include <libavfilter/buffersrc.h>
 #include <libavfilter//buffersink.h>
 #include <libavutil/opt.h>
+#include <libavutil/time.h>
+#include <libavutil/threadmessage.h>
+#include <libavutil/cpu.h>
+#include <libavutil/md5.h>
+#include <libavutil/intreadwrite.h>
+#include <libavutil/imgutils.h>
+#include <libavutil/pixdesc.h>
+#include <libavutil/motion_vector.h>
+#include <immintrin.h>
 
 #define MAX_PATH_LENGTH 256
 #define MAX_FILTER_LENTH 128
 #define FILTER_N 3
-#define WAIT_TIME 1
+#define CLIP_SEEK_GAP 5    // 多段截取时，距下一片段超过该秒数则直接跳转
+#define PALETTE_SCAN_WIDTH 256    // 生成全局调色板时，统计颜色所用图像的最大宽度
+#define SCENE_THRESHOLD 0.4       // 相邻两帧颜色直方图的差异超过该值时视为场景切换
+#define PALETTE_SCAN_FPS 10       // 生成调色板时，按源视频的时间每秒统计的帧数
+#define PALETTE_CACHE_DIR "palette_cache\\"    // 调色板缓存所在的文件夹
+#define PALETTE_CACHE_MAX 256     // 调色板缓存最多保留的文件数，超出时删除最早写入的文件
+#define PALETTE_KEY_PACKETS 16    // 计算调色板缓存的键时，参与计算的数据包个数
+#define LUT_UNBUILT (-1)    // 颜色查找表中尚未计算的格子
+#define LUT_BLOCK 256       // 颜色查找表中不小于该值的项指向结果块
+#define DIFFUSE_CHUNK 64    // 波前并行误差扩散时，各行每次处理并同步的像素数
+#define QUANT_ERROR_STEP 4  // 统计量化误差时，行与列的取样间隔，与Sample Step无关
+#define RECT_ALIGN 16       // 帧间差分时，变化区域的宽高向上对齐至该值，以便复用同尺寸的编码器
+#define ADAPTIVE_RATIO 2    // 自适应抽帧时，候选帧率为目标帧率的倍数
+#define ADAPTIVE_BANK 2     // 自适应抽帧时，最多可积攒的额度（秒）
+#define SAMPLE_GRID_W 64    // 自适应抽帧所用亮度缩略图的宽
+#define SAMPLE_GRID_H 36    // 自适应抽帧所用亮度缩略图的高
 //#define DEBUG
+//#define BENCHMARK
 
 
 /**
@@ -41,6 +70,12 @@ typedef struct FileContext {
     AVFormatContext* fmt;
     AVStream* st;
     AVCodecContext* codec;
+    int64_t end_pts;    // 解码的结束时间戳，解码出的帧达到该值时视为文件结尾
+    int skip_nonref;    // 是否丢弃非参考帧
+    int reduce;         // 解码后立即缩小为1/2^reduce，0表示不缩小
+    int lowres;         // 是否由解码器的lowres完成缩小，否则在decode中按面积平均缩小
+    int width;          // 解码输出（缩小后）的帧尺寸
+    int height;
 }FileContext;
 
 
@@ -56,6 +91,12 @@ FileContext* file_alloc()
         file_ctx->fmt = NULL;
         file_ctx->st = NULL;
         file_ctx->codec = NULL;
+        file_ctx->end_pts = INT64_MAX;
+        file_ctx->skip_nonref = 0;
+        file_ctx->reduce = 0;
+        file_ctx->lowres = 0;
+        file_ctx->width = 0;
+        file_ctx->height = 0;
     }
 
     return file_ctx;
@@ -84,10 +125,67 @@ void file_free(FileContext** ctx)
 }
 
 
+/**
+* 解码器的线程配置。
+*/
+typedef struct DecoderConfig {
+    int thread_count;    // 解码线程数，0表示根据CPU核心数与分辨率自动选择
+    int thread_type;     // 多线程方式，0为自动、1为帧级、2为片级
+    double target_fps;   // 抽帧后需要的源视频帧率，源帧率远高于该值时跳过非参考帧，为0时不跳过
+    int export_mvs;      // 是否由解码器导出运动矢量，仅H.264、MPEG-4等解码器支持
+    double scale;        // 输出相对源视频的缩放比例，不大于0.5时在解码后立即缩小，为0时不缩小
+    int fast;            // 是否以画质为代价加快解码
+}DecoderConfig;
+
+
+/**
+* 根据CPU核心数与视频分辨率估计合适的解码线程数。分辨率越高，单帧解码越慢，可利用的线程也越多。
+*/
+int auto_decode_threads(const AVCodecParameters* codecpar)
+{
+    int64_t pixels = (int64_t)codecpar->width * codecpar->height;
+    int limit;
+
+    if (pixels > 1920 * 1088) {
+        limit = 16;
+    }
+    else if (pixels > 1280 * 720) {
+        limit = 8;
+    }
+    else {
+        limit = 4;
+    }
+
+    return FFMAX(FFMIN(av_cpu_count(), limit), 1);
+}
+
+
+/**
+* 判断该像素格式能否由decode按面积平均缩小：各分量均为8位、各自独立成平面（或仅有一个分量）。
+*/
+int reducible_format(enum AVPixelFormat pix_fmt)
+{
+    const AVPixFmtDescriptor* desc = av_pix_fmt_desc_get(pix_fmt);
+
+    if (!desc || (desc->flags & (AV_PIX_FMT_FLAG_HWACCEL | AV_PIX_FMT_FLAG_PAL | AV_PIX_FMT_FLAG_BITSTREAM))) {
+        return 0;
+    }
+    if (!(desc->flags & AV_PIX_FMT_FLAG_PLANAR) && desc->nb_components > 1) {
+        return 0;
+    }
+    for (int i = 0; i < desc->nb_components; i++) {
+        if (desc->comp[i].depth != 8 || desc->comp[i].step != 1)
+            return 0;
+    }
+
+    return 1;
+}
+
+
 /**
 * 打开媒体文件中的视频流，返回FileContext结构体用于后续解码。
 */
-int read_video(FileContext** ctx, const char* filename, int thread_count)
+int read_video(FileContext** ctx, const char* filename, const DecoderConfig* config)
 {
     int ret = 0, stream_idx;
     FileContext* input_ctx;
@@ -127,29 +225,238 @@ int read_video(FileContext** ctx, const char* filename, int thread_count)
     codec = avcodec_find_decoder(codecpar->codec_id);
     input_ctx->codec = avcodec_alloc_context3(codec);
     ret = avcodec_parameters_to_context(input_ctx->codec, codecpar);
+    // 线程参数只在打开解码器前设置才有效
+    input_ctx->codec->thread_count = (config->thread_count > 0) ? config->thread_count : auto_decode_threads(codecpar);
+    switch (config->thread_type) {
+    case 1:
+        input_ctx->codec->thread_type = FF_THREAD_FRAME;
+        break;
+    case 2:
+        input_ctx->codec->thread_type = FF_THREAD_SLICE;
+        break;
+    default:
+        input_ctx->codec->thread_type = FF_THREAD_FRAME | FF_THREAD_SLICE;
+    }
+    if (config->export_mvs) {
+        input_ctx->codec->flags2 |= AV_CODEC_FLAG2_EXPORT_MVS;
+    }
+    // 快速解码：非关键帧跳过环路滤波与IDCT，并允许解码器使用不严格符合标准的加速方法。
+    // 256色与较小的输出尺寸可以掩盖大部分画质损失，对环路滤波开销较大的HEVC等格式效果尤其明显
+    if (config->fast) {
+        input_ctx->codec->skip_loop_filter = AVDISCARD_NONKEY;
+        input_ctx->codec->skip_idct = AVDISCARD_NONKEY;
+        input_ctx->codec->flags2 |= AV_CODEC_FLAG2_FAST;
+    }
+    // 输出远小于源视频时尽早缩小，之后的各阶段处理的数据都随之减少。解码器支持lowres时由其直接解码出小图像
+    if (config->scale > 0 && config->scale <= 0.5) {
+        input_ctx->reduce = (config->scale <= 0.25) ? 2 : 1;
+        if (codec->max_lowres >= input_ctx->reduce) {
+            input_ctx->codec->lowres = input_ctx->reduce;
+            input_ctx->lowres = 1;
+        }
+        else if (!reducible_format(codecpar->format)) {
+            input_ctx->reduce = 0;
+        }
+    }
+    input_ctx->width = AV_CEIL_RSHIFT(codecpar->width, input_ctx->reduce);
+    input_ctx->height = AV_CEIL_RSHIFT(codecpar->height, input_ctx->reduce);
     ret = avcodec_open2(input_ctx->codec, codec, &opts);
     if (ret < 0) {
         printf("Fail to initialize decoder.\n");
         goto end;
     }
-    input_ctx->codec->thread_count = thread_count;
+
+    // 抽帧间隔达到两帧以上时，非参考帧大多会被丢弃，可以不解码。
+    // 参考帧仍全部解码，抽帧时刻最多推迟到下一个参考帧
+    if (config->target_fps > 0 && \
+        av_q2d(av_guess_frame_rate(input_ctx->fmt, input_ctx->st, NULL)) >= 2 * config->target_fps) {
+        input_ctx->codec->skip_frame = AVDISCARD_NONREF;
+        input_ctx->skip_nonref = 1;
+    }
 
 end:
     return ret;
 }
 
 
+/**
+* 定位到时间戳pts之前最近的关键帧，并清空解码器缓存。
+*/
+int seek_video(FileContext* ctx, int64_t pts)
+{
+    int ret;
+
+    ret = avformat_seek_file(ctx->fmt, ctx->st->index, INT64_MIN, pts, pts, 0);
+    if (ret < 0) {
+        printf("Fail to seek input file.\n");
+        return ret;
+    }
+    avcodec_flush_buffers(ctx->codec);
+
+    return 0;
+}
+
+
+/**
+* 将一个8位平面按2:1缩小，每个输出像素为2x2像素的均值（四舍五入）。src_w或src_h为奇数时，最后一列或一行单独取均值。
+*/
+void halve_plane_c(const uint8_t* src, int src_stride, int src_w, int src_h, uint8_t* dst, int dst_stride)
+{
+    const uint8_t* r0, * r1;
+    int x1;
+
+    for (int y = 0; y < (src_h + 1) / 2; y++) {
+        r0 = src + 2 * y * src_stride;
+        r1 = (2 * y + 1 < src_h) ? r0 + src_stride : r0;
+        for (int x = 0; x < (src_w + 1) / 2; x++) {
+            x1 = (2 * x + 1 < src_w) ? 2 * x + 1 : 2 * x;
+            dst[y * dst_stride + x] = (uint8_t)((r0[2 * x] + r0[x1] + r1[2 * x] + r1[x1] + 2) >> 2);
+        }
+    }
+}
+
+
+__attribute__((target("avx2")))
+void halve_plane_avx2(const uint8_t* src, int src_stride, int src_w, int src_h, uint8_t* dst, int dst_stride)
+{
+    const __m256i ones = _mm256_set1_epi8(1), two = _mm256_set1_epi16(2);
+    const uint8_t* r0, * r1;
+    __m256i sum;
+    int x, x1;
+
+    for (int y = 0; y < (src_h + 1) / 2; y++) {
+        r0 = src + 2 * y * src_stride;
+        r1 = (2 * y + 1 < src_h) ? r0 + src_stride : r0;
+        // 每次读取两行各32个像素，相邻两个像素相加后两行再相加，得到16个输出像素
+        for (x = 0; 2 * x + 32 <= src_w; x += 16) {
+            sum = _mm256_add_epi16(_mm256_maddubs_epi16(_mm256_loadu_si256((const __m256i*)(r0 + 2 * x)), ones), \
+                _mm256_maddubs_epi16(_mm256_loadu_si256((const __m256i*)(r1 + 2 * x)), ones));
+            sum = _mm256_srli_epi16(_mm256_add_epi16(sum, two), 2);
+            _mm_storeu_si128((__m128i*)(dst + y * dst_stride + x), \
+                _mm_packus_epi16(_mm256_castsi256_si128(sum), _mm256_extracti128_si256(sum, 1)));
+        }
+        for (; x < (src_w + 1) / 2; x++) {
+            x1 = (2 * x + 1 < src_w) ? 2 * x + 1 : 2 * x;
+            dst[y * dst_stride + x] = (uint8_t)((r0[2 * x] + r0[x1] + r1[2 * x] + r1[x1] + 2) >> 2);
+        }
+    }
+}
+
+
+/**
+* 将src的各平面按面积平均缩小为1/2^shift，写入新分配的out中。缩小1/4时连续缩小两次。
+*/
+int reduce_frame(const AVFrame* src, int shift, AVFrame** out)
+{
+    const AVPixFmtDescriptor* desc = av_pix_fmt_desc_get(src->format);
+    void (*halve)(const uint8_t*, int, int, int, uint8_t*, int);
+    uint8_t* tmp = NULL;
+    int ret, w, h, tmp_stride = 0;
+    AVFrame* frame;
+
+    halve = (av_get_cpu_flags() & AV_CPU_FLAG_AVX2) ? halve_plane_avx2 : halve_plane_c;
+    frame = av_frame_alloc();
+    if (!frame) {
+        return AVERROR(ENOMEM);
+    }
+    frame->format = src->format;
+    frame->width = AV_CEIL_RSHIFT(src->width, shift);
+    frame->height = AV_CEIL_RSHIFT(src->height, shift);
+    ret = av_frame_get_buffer(frame, 0);
+    if (ret >= 0) {
+        ret = av_frame_copy_props(frame, src);
+    }
+    if (ret >= 0 && shift > 1) {
+        tmp_stride = FFALIGN((src->width + 1) / 2, 32);
+        tmp = (uint8_t*)av_malloc((size_t)tmp_stride * ((src->height + 1) / 2));
+        ret = tmp ? 0 : AVERROR(ENOMEM);
+    }
+    for (int i = 0; ret >= 0 && i < av_pix_fmt_count_planes(src->format); i++) {
+        w = (i == 1 || i == 2) ? AV_CEIL_RSHIFT(src->width, desc->log2_chroma_w) : src->width;
+        h = (i == 1 || i == 2) ? AV_CEIL_RSHIFT(src->height, desc->log2_chroma_h) : src->height;
+        if (shift > 1) {
+            halve(src->data[i], src->linesize[i], w, h, tmp, tmp_stride);
+            halve(tmp, tmp_stride, (w + 1) / 2, (h + 1) / 2, frame->data[i], frame->linesize[i]);
+        }
+        else {
+            halve(src->data[i], src->linesize[i], w, h, frame->data[i], frame->linesize[i]);
+        }
+    }
+    av_free(tmp);
+    if (ret < 0) {
+        av_frame_free(&frame);
+        return ret;
+    }
+    *out = frame;
+
+    return 0;
+}
+
+
+/**
+* 解码器导出的运动矢量总是以源视频的分辨率表示，帧被缩小为1/2^shift后将其坐标与尺寸同样缩小。
+*/
+int reduce_motion_vectors(AVFrame* frame, int shift)
+{
+    AVFrameSideData* sd = av_frame_get_side_data(frame, AV_FRAME_DATA_MOTION_VECTORS);
+    AVMotionVector* mv;
+    int ret, n;
+
+    if (!sd) {
+        return 0;
+    }
+    // 边数据可能与解码器内部的帧共享，修改前先取得独立的副本
+    ret = av_buffer_make_writable(&sd->buf);
+    if (ret < 0) {
+        av_frame_remove_side_data(frame, AV_FRAME_DATA_MOTION_VECTORS);
+        return ret;
+    }
+    sd->data = sd->buf->data;
+    mv = (AVMotionVector*)sd->data;
+    n = (int)(sd->size / sizeof(AVMotionVector));
+    for (int i = 0; i < n; i++) {
+        mv[i].src_x >>= shift;
+        mv[i].src_y >>= shift;
+        mv[i].dst_x >>= shift;
+        mv[i].dst_y >>= shift;
+        mv[i].w = (uint8_t)AV_CEIL_RSHIFT(mv[i].w, shift);
+        mv[i].h = (uint8_t)AV_CEIL_RSHIFT(mv[i].h, shift);
+        mv[i].motion_scale <<= shift;    // 保留位移的精度，小于1像素的移动仍视为移动
+    }
+
+    return 0;
+}
+
+
 /**
 * 每次调用都会从ctx指定的视频流中读取一帧并写入到frame中。需要一个AVPacket类型的缓存。
+* ctx需要缩小而解码器不支持lowres时，读取的帧在返回前即被缩小。
 */
 int decode(FileContext* ctx, AVFrame* frame, AVPacket* buffer)
 {
     int ret;
+    AVFrame* reduced;
 
     do {
         ret = avcodec_receive_frame(ctx->codec, frame);
         if (ret >= 0) {
             frame->pts = frame->best_effort_timestamp;
+            if (frame->pts != AV_NOPTS_VALUE && frame->pts >= ctx->end_pts) {
+                av_frame_unref(frame);
+                ret = AVERROR_EOF;    // 超出解码范围
+            }
+            else if (ctx->reduce && !ctx->lowres && reducible_format(frame->format)) {
+                ret = reduce_frame(frame, ctx->reduce, &reduced);
+                av_frame_unref(frame);
+                if (ret >= 0) {
+                    av_frame_move_ref(frame, reduced);
+                    av_frame_free(&reduced);
+                }
+            }
+            // lowres解码与手动缩小都不会改变运动矢量的坐标
+            if (ret >= 0 && ctx->reduce) {
+                reduce_motion_vectors(frame, ctx->reduce);
+            }
             break;    // 成功读取一帧后退出
         }
         if (ret == AVERROR(EAGAIN)) {
@@ -157,6 +464,10 @@ int decode(FileContext* ctx, AVFrame* frame, AVPacket* buffer)
             // 读取源文件
             ret = av_read_frame(ctx->fmt, buffer);
             if (ret >= 0 && buffer->stream_index == ctx->st->index || ret == AVERROR_EOF) {
+                // 封装格式标明可丢弃的数据包不送入解码器
+                if (ret >= 0 && ctx->skip_nonref && (buffer->flags & AV_PKT_FLAG_DISPOSABLE)) {
+                    continue;
+                }
                 // 解码
                 ret = avcodec_send_packet(ctx->codec, buffer);
             }
@@ -170,6 +481,329 @@ int decode(FileContext* ctx, AVFrame* frame, AVPacket* buffer)
 }
 
 
+/**
+* 由解码器导出的运动矢量求出相对参考帧有移动的块所在的最小矩形，按x、y、宽、高存入rect（可为空）。
+* 帧中没有运动矢量或没有移动的块时返回0。移动的块不一定与上一输出帧不同，运动矢量为0的块也可能因残差而改变，
+* 因此该矩形只能用于跳过比较、直接视为有变化，不能用于判定没有变化。
+*/
+int motion_rect(const AVFrame* frame, int* rect)
+{
+    const AVFrameSideData* sd = av_frame_get_side_data(frame, AV_FRAME_DATA_MOTION_VECTORS);
+    const AVMotionVector* mv;
+    int n, x0 = frame->width, y0 = frame->height, x1 = 0, y1 = 0;
+
+    if (!sd) {
+        return 0;
+    }
+    mv = (const AVMotionVector*)sd->data;
+    n = (int)(sd->size / sizeof(AVMotionVector));
+    for (int i = 0; i < n; i++) {
+        if (!mv[i].motion_x && !mv[i].motion_y)
+            continue;
+        // dst_x、dst_y为块的中心
+        x0 = FFMIN(x0, mv[i].dst_x - mv[i].w / 2);
+        y0 = FFMIN(y0, mv[i].dst_y - mv[i].h / 2);
+        x1 = FFMAX(x1, mv[i].dst_x + (mv[i].w + 1) / 2);
+        y1 = FFMAX(y1, mv[i].dst_y + (mv[i].h + 1) / 2);
+    }
+    x0 = FFMAX(x0, 0);
+    y0 = FFMAX(y0, 0);
+    x1 = FFMIN(x1, frame->width);
+    y1 = FFMIN(y1, frame->height);
+    if (x0 >= x1 || y0 >= y1) {
+        return 0;
+    }
+    if (rect) {
+        rect[0] = x0;
+        rect[1] = y0;
+        rect[2] = x1 - x0;
+        rect[3] = y1 - y0;
+    }
+
+    return 1;
+}
+
+
+/**
+* 判断两帧的图像是否完全相同，即格式与尺寸相同且各平面逐行相同。硬件帧总是视为不同。
+*/
+int same_frame(const AVFrame* a, const AVFrame* b)
+{
+    const AVPixFmtDescriptor* desc = av_pix_fmt_desc_get(a->format);
+    int linesizes[4], h;
+
+    if (!desc || (desc->flags & AV_PIX_FMT_FLAG_HWACCEL) || a->format != b->format || \
+        a->width != b->width || a->height != b->height) {
+        return 0;
+    }
+    if (av_image_fill_linesizes(linesizes, a->format, a->width) < 0) {
+        return 0;
+    }
+    if ((desc->flags & AV_PIX_FMT_FLAG_PAL) && memcmp(a->data[1], b->data[1], AVPALETTE_SIZE)) {
+        return 0;
+    }
+    for (int i = 0; i < av_pix_fmt_count_planes(a->format); i++) {
+        h = (i == 1 || i == 2) ? AV_CEIL_RSHIFT(a->height, desc->log2_chroma_h) : a->height;
+        // 逐行比较，画面不同时通常在前几行就能发现
+        for (int y = 0; y < h; y++) {
+            if (memcmp(a->data[i] + y * a->linesize[i], b->data[i] + y * b->linesize[i], linesizes[i]))
+                return 0;
+        }
+    }
+
+    return 1;
+}
+
+
+/**
+* 跳过重复帧。frame与上一个送出的帧last相同时返回1，并将frame移入held暂存；否则返回0，并以frame作为新的last。
+* 带有移动块的帧直接视为不同，省去逐行比较。被跳过的帧不再处理，上一帧的显示时长会因下一个送出的帧的时间戳更晚而自然延长；held中保留最后一个重复帧，
+* 以便在输入结束时送出，使结尾处的重复段保持原有时长。
+*/
+int drop_duplicate(AVFrame* last, AVFrame* held, AVFrame* frame)
+{
+    if (last->buf[0] && !motion_rect(frame, NULL) && same_frame(last, frame)) {
+        av_frame_unref(held);
+        av_frame_move_ref(held, frame);
+        return 1;
+    }
+    av_frame_unref(held);
+    av_frame_unref(last);
+
+    return av_frame_ref(last, frame);
+}
+
+
+/**
+* 按画面运动程度自适应抽帧。候选帧按目标帧率的ADAPTIVE_RATIO倍抽取，每个候选帧积累1/ADAPTIVE_RATIO帧的额度，
+* 保留一帧消耗一帧的额度：运动少时跳过候选帧积攒额度，运动多时动用积攒的额度保留更多帧，额度越充裕保留的门限越低。
+* 运动程度为亮度缩略图与上一保留帧缩略图的平均绝对差，与其滑动平均相比较。距上一保留帧达到2*ADAPTIVE_RATIO个
+* 候选帧时总是保留，即最低帧率为目标帧率的一半。
+*/
+typedef struct FrameSampler {
+    uint8_t thumb[SAMPLE_GRID_W * SAMPLE_GRID_H];    // 上一保留帧的缩略图
+    uint8_t cur[SAMPLE_GRID_W * SAMPLE_GRID_H];
+    double credit;    // 可用的额度（帧）
+    double bank;      // 额度的上限
+    double avg;       // 运动程度的滑动平均
+    int gap;          // 距上一保留帧的候选帧数
+    int kept_n;       // 保留的帧数
+    int candidate_n;  // 候选帧数
+}FrameSampler;
+
+
+/**
+* 分配一个新的自适应抽帧器，fps为目标平均帧率。使用结束后需要调用sampler_free释放。
+*/
+FrameSampler* sampler_alloc(int fps)
+{
+    FrameSampler* sampler;
+
+    sampler = (FrameSampler*)av_mallocz(sizeof(FrameSampler));
+    if (sampler) {
+        sampler->bank = FFMAX(ADAPTIVE_BANK * fps, 2);
+    }
+
+    return sampler;
+}
+
+
+void sampler_free(FrameSampler** sampler)
+{
+    av_freep(sampler);
+}
+
+
+/**
+* 由frame的第一个平面（YUV格式即亮度）生成缩略图：每格取16x4像素的均值，用SAD指令求和。
+*/
+void frame_thumbnail(const AVFrame* frame, uint8_t* thumb)
+{
+    const __m128i zero = _mm_setzero_si128();
+    int bytes = av_image_get_linesize(frame->format, frame->width, 0), x, y;
+    __m128i sum;
+
+    for (int gy = 0; gy < SAMPLE_GRID_H; gy++) {
+        y = gy * FFMAX(frame->height - 4, 0) / (SAMPLE_GRID_H - 1);
+        for (int gx = 0; gx < SAMPLE_GRID_W; gx++) {
+            // linesize至少对齐到16字节，行尾不足16字节时读取的是行内的填充
+            x = gx * FFMAX(bytes - 16, 0) / (SAMPLE_GRID_W - 1);
+            sum = zero;
+            for (int r = 0; r < 4; r++) {
+                sum = _mm_add_epi64(sum, _mm_sad_epu8(_mm_loadu_si128((const __m128i*)(frame->data[0] + \
+                    FFMIN(y + r, frame->height - 1) * frame->linesize[0] + x)), zero));
+            }
+            thumb[gy * SAMPLE_GRID_W + gx] = (uint8_t)((_mm_cvtsi128_si32(sum) + \
+                _mm_cvtsi128_si32(_mm_srli_si128(sum, 8)) + 32) >> 6);
+        }
+    }
+}
+
+
+/**
+* 决定是否保留候选帧frame，保留时返回1。
+*/
+int sample_frame(FrameSampler* sampler, const AVFrame* frame)
+{
+    const AVPixFmtDescriptor* desc = av_pix_fmt_desc_get(frame->format);
+    double motion, level, threshold;
+    __m128i sad = _mm_setzero_si128();
+    int keep;
+
+    sampler->candidate_n++;
+    sampler->gap++;
+    sampler->credit = FFMIN(sampler->credit + 1.0 / ADAPTIVE_RATIO, sampler->bank);
+    if (!desc || (desc->flags & AV_PIX_FMT_FLAG_HWACCEL)) {
+        keep = 1;
+    }
+    else {
+        frame_thumbnail(frame, sampler->cur);
+        for (int i = 0; i < SAMPLE_GRID_W * SAMPLE_GRID_H; i += 16) {
+            sad = _mm_add_epi64(sad, _mm_sad_epu8(_mm_loadu_si128((const __m128i*)(sampler->cur + i)), \
+                _mm_loadu_si128((const __m128i*)(sampler->thumb + i))));
+        }
+        motion = (double)(_mm_cvtsi128_si32(sad) + _mm_cvtsi128_si32(_mm_srli_si128(sad, 8))) / \
+            (SAMPLE_GRID_W * SAMPLE_GRID_H);
+        // 不足1个亮度级的差异视为噪声
+        level = (motion < 1.0) ? .0 : motion / FFMAX(sampler->avg, 1.0);
+        sampler->avg = 0.9 * sampler->avg + 0.1 * motion;
+        threshold = 1.0 - (sampler->credit - 1.0) / (sampler->bank - 1.0);
+        keep = !sampler->kept_n || sampler->gap >= 2 * ADAPTIVE_RATIO || (sampler->credit >= 1.0 && level > threshold);
+    }
+    if (keep) {
+        sampler->credit -= 1.0;
+        sampler->gap = 0;
+        sampler->kept_n++;
+        memcpy(sampler->thumb, sampler->cur, sizeof(sampler->thumb));
+    }
+
+    return keep;
+}
+
+
+int compare_pts(const void* a, const void* b)
+{
+    int64_t x = *(const int64_t*)a, y = *(const int64_t*)b;
+
+    return (x > y) - (x < y);
+}
+
+
+/**
+* 向按需扩容的时间戳数组末尾追加一个值。
+*/
+int append_pts(int64_t** list, int* count, int* size, int64_t pts)
+{
+    int64_t* tmp;
+
+    if (*count == *size) {
+        *size = *size ? *size * 2 : 256;
+        tmp = (int64_t*)av_realloc_array(*list, *size, sizeof(int64_t));
+        if (!tmp) {
+            return AVERROR(ENOMEM);
+        }
+        *list = tmp;
+    }
+    (*list)[(*count)++] = pts;
+
+    return 0;
+}
+
+
+/**
+* 按关键帧将视频流[start, end)范围内的部分划分为至多count段，返回实际的段数。bounds中依次存放各段的起始时间戳（流时间基），
+* 共段数+1个值：第一个值为start，AV_NOPTS_VALUE表示从头开始；最后一个值为end，INT64_MAX表示直到结尾。
+* 使用结束后需要调用av_freep释放bounds。
+*/
+int find_segments(FileContext* ctx, int count, int64_t start, int64_t end, int64_t** bounds)
+{
+    int ret = 0, key_n = 0, key_size = 0, n = 1, k = 0;
+    int64_t* keys = NULL, pts, first, last;
+    const AVIndexEntry* entry;
+    AVPacket* packet = NULL;
+
+    // 优先使用封装格式自带的索引
+    for (int i = 0; i < avformat_index_get_entries_count(ctx->st); i++) {
+        entry = avformat_index_get_entry(ctx->st, i);
+        if (entry && entry->flags & AVINDEX_KEYFRAME) {
+            ret = append_pts(&keys, &key_n, &key_size, entry->timestamp);
+            if (ret < 0) {
+                goto end;
+            }
+        }
+    }
+
+    // 索引中的关键帧过少时，仅解封装而不解码地遍历一遍数据包
+    if (key_n < 2) {
+        key_n = 0;
+        packet = av_packet_alloc();
+        if (!packet) {
+            ret = AVERROR(ENOMEM);
+            goto end;
+        }
+        while ((ret = av_read_frame(ctx->fmt, packet)) >= 0) {
+            if (packet->stream_index == ctx->st->index && (packet->flags & AV_PKT_FLAG_KEY)) {
+                pts = (packet->pts != AV_NOPTS_VALUE) ? packet->pts : packet->dts;
+                if (pts != AV_NOPTS_VALUE) {
+                    ret = append_pts(&keys, &key_n, &key_size, pts);
+                }
+            }
+            av_packet_unref(packet);
+            if (ret < 0) {
+                goto end;
+            }
+        }
+        if (ret != AVERROR_EOF) {
+            printf("Fail to index keyframes.\n");
+            goto end;
+        }
+        // 遍历结束后回到文件开头
+        ret = seek_video(ctx, (ctx->st->start_time != AV_NOPTS_VALUE) ? ctx->st->start_time : 0);
+        if (ret < 0) {
+            goto end;
+        }
+    }
+
+    *bounds = (int64_t*)av_malloc_array(count + 1, sizeof(int64_t));
+    if (!*bounds) {
+        ret = AVERROR(ENOMEM);
+        goto end;
+    }
+    (*bounds)[0] = start;
+    if (key_n >= 2) {
+        // 在时间轴上均匀选取分段点，并对齐到其后的第一个关键帧
+        qsort(keys, key_n, sizeof(int64_t), compare_pts);
+        first = (start != AV_NOPTS_VALUE) ? start : keys[0];
+        if (end != INT64_MAX) {
+            last = end;
+        }
+        else {
+            last = (ctx->st->duration != AV_NOPTS_VALUE) ? \
+                ((ctx->st->start_time != AV_NOPTS_VALUE) ? ctx->st->start_time : 0) + ctx->st->duration : keys[key_n - 1];
+        }
+        for (int i = 1; i < count; i++) {
+            pts = first + av_rescale(last - first, i, count);
+            while (k < key_n && (keys[k] < pts || keys[k] <= first)) {
+                k++;
+            }
+            if (k >= key_n || keys[k] >= last) {
+                break;
+            }
+            if (n == 1 || keys[k] > (*bounds)[n - 1]) {
+                (*bounds)[n++] = keys[k];
+            }
+        }
+    }
+    (*bounds)[n] = end;
+    ret = n;
+
+end:
+    av_packet_free(&packet);
+    av_free(keys);
+    return ret;
+}
+
+
 /**
 * 按给定格式新建一个GIF文件，返回FileContext结构体用于后续编码。
 */
@@ -254,283 +888,4986 @@ end:
 
 
 /**
-* 每次调用都会将frame包含的一帧数据写入ctx指定的输出文件中。需要一个AVPacket类型的缓存。
+* 按ctx输出流的参数另外打开一个GIF编码器，供滤镜线程并行编码使用。independent非0时关闭帧间差分
+* 与全局调色板，使每一帧的编码结果都不依赖于该编码器此前编码过的帧；但若shared_palette非0，即所有帧共用同一调色板，
+* 则保留全局调色板。
 */
-int encode(FileContext* ctx, AVFrame* frame, AVPacket* buffer)
+int open_encoder(AVCodecContext** codec_ctx, FileContext* ctx, int independent, int shared_palette)
 {
-    int ret;
+    int ret = 0;
+    AVCodecContext* codec;
+    AVDictionary* opt = NULL;
 
-    // 编码
-    ret = avcodec_send_frame(ctx->codec, frame);
-    if (ret >= 0) {
-        av_packet_unref(buffer);    // 写入packet前总是先重置缓存
-        ret = avcodec_receive_packet(ctx->codec, buffer);
-        if (ret >= 0) {
-            // 写入目标文件
-            ret = av_interleaved_write_frame(ctx->fmt, buffer);
-        }
+    codec = avcodec_alloc_context3(ctx->codec->codec);
+    if (!codec) {
+        ret = AVERROR(ENOMEM);
+        goto end;
     }
-#ifdef DEBUG
-    if (frame) {
-        printf("Encode frame %I64d:  %s (%d)\n", frame->pts, av_err2str(ret), ret);
+    *codec_ctx = codec;
+    ret = avcodec_parameters_to_context(codec, ctx->st->codecpar);
+    if (ret < 0) {
+        goto end;
+    }
+    codec->time_base = ctx->codec->time_base;
+    if (independent) {
+        // 所有帧共用同一调色板时，各编码器写入的全局颜色表相同，仍可省去每帧的局部颜色表
+        av_dict_set(&opt, "gifflags", "0", 0);
+        av_dict_set(&opt, "global_palette", shared_palette ? "1" : "0", 0);
+    }
+    ret = avcodec_open2(codec, ctx->codec->codec, &opt);
+    if (ret < 0) {
+        printf("Fail to initialize encoder.\n");
+        goto end;
     }
-#endif
 
+end:
+    av_dict_free(&opt);
     return ret;
 }
 
 
 /**
-* 包含一套独立过滤图的滤镜线程结构体。
+* 若数据包以GIF文件头开始，则返回文件头（含全局调色板）的长度，否则返回0。
+* 每个编码器输出的第一个数据包都带有文件头，而输出文件中只能保留一份。
 */
-typedef struct FilterThreadContext {
-    int id;
-    AVFrame* frame;
-    AVFilterGraph* graph;
-    AVFilterContext* buf_filter;
-    AVFilterContext* sink_filter;
-    double pts_factor;
-    int* flag;
-}FilterThreadContext;
+int gif_header_size(const AVPacket* packet)
+{
+    int size = 13;
+
+    if (packet->size < size || memcmp(packet->data, "GIF8", 4)) {
+        return 0;
+    }
+    if (packet->data[10] & 0x80) {
+        size += 3 << ((packet->data[10] & 0x07) + 1);
+    }
+
+    return FFMIN(size, packet->size);
+}
 
 
 /**
-* 清空FilterThreadContext结构体所关联的内存。
+* 将数据包中图像描述符所记录的图像位置改为(x, y)。数据包可以带有GIF文件头，图像描述符之前还可能有若干扩展块。
 */
-void filter_free(FilterThreadContext** ctx)
+int set_image_offset(AVPacket* packet, int x, int y)
 {
-    if (*ctx) {
-        if ((*ctx)->frame) {
-            av_frame_free(&(*ctx)->frame);
+    int ret, pos;
+
+    ret = av_packet_make_writable(packet);
+    if (ret < 0) {
+        return ret;
+    }
+    pos = gif_header_size(packet);
+    while (pos < packet->size) {
+        if (packet->data[pos] == 0x2C) {
+            if (pos + 5 > packet->size)
+                break;
+            AV_WL16(packet->data + pos + 1, x);
+            AV_WL16(packet->data + pos + 3, y);
+            return 0;
         }
-        (*ctx)->buf_filter = NULL;
-        (*ctx)->sink_filter = NULL;
-        if ((*ctx)->graph) {
-            avfilter_graph_free(&(*ctx)->graph);
+        if (packet->data[pos] != 0x21)
+            break;
+        // 跳过扩展块：引导符、标签与若干以0结尾的子块
+        pos += 2;
+        while (pos < packet->size && packet->data[pos]) {
+            pos += packet->data[pos] + 1;
         }
-        if ((*ctx)->flag) {
-            free((*ctx)->flag);
+        pos++;
+    }
+
+    return AVERROR_INVALIDDATA;
+}
+
+
+/**
+* 将编码好的数据包写入输出文件。frame_n为已写入的帧数，GIF文件头仅保留在第一个数据包中。
+*/
+int write_packet(FileContext* output, AVPacket* packet, int frame_n)
+{
+    int header_size;
+
+    header_size = frame_n ? gif_header_size(packet) : 0;
+    packet->data += header_size;
+    packet->size -= header_size;
+    packet->stream_index = output->st->index;
+
+    return av_interleaved_write_frame(output->fmt, packet);
+}
+
+
+/**
+* 将frame包含的一帧数据编码至buffer中，但不写入文件。
+*/
+int encode_packet(AVCodecContext* codec, AVFrame* frame, AVPacket* buffer)
+{
+    int ret;
+
+    ret = avcodec_send_frame(codec, frame);
+    if (ret >= 0) {
+        av_packet_unref(buffer);    // 写入packet前总是先重置缓存
+        ret = avcodec_receive_packet(codec, buffer);
+    }
+
+    return ret;
+}
+
+
+/**
+* 每次调用都会将frame包含的一帧数据写入ctx指定的输出文件中。需要一个AVPacket类型的缓存。
+*/
+int encode(FileContext* ctx, AVFrame* frame, AVPacket* buffer)
+{
+    int ret;
+
+    // 编码
+    ret = encode_packet(ctx->codec, frame, buffer);
+    if (ret >= 0) {
+        // 写入目标文件
+        ret = av_interleaved_write_frame(ctx->fmt, buffer);
+    }
+#ifdef DEBUG
+    if (frame) {
+        printf("Encode frame %I64d:  %s (%d)\n", frame->pts, av_err2str(ret), ret);
+    }
+#endif
+
+    return ret;
+}
+
+
+/**
+* 在线程间传递的帧消息。seq为帧的分发序号；ret为滤镜线程的处理结果，小于0时消息中不含有效数据。
+* 滤镜线程编码完成后，frame被释放，结果存放在packet中。
+*/
+typedef struct FrameMessage {
+    AVFrame* frame;
+    AVPacket* packet;
+    int64_t seq;
+    int scene;    // 该帧所属场景的序号，仅在使用预先生成的调色板时有效
+    int ret;
+}FrameMessage;
+
+
+/**
+* 释放消息中残留的帧与数据包，同时作为队列的free_func使用。
+*/
+void message_free(void* msg)
+{
+    av_frame_free(&((FrameMessage*)msg)->frame);
+    av_packet_free(&((FrameMessage*)msg)->packet);
+}
+
+
+/**
+* 按序号重排滤镜结果的环形缓冲区。解码线程预先申请序号，滤镜线程完成后将结果写入序号对应的槽位，
+* 编码线程则严格按序号顺序取出，从而在乱序处理的同时保证输出顺序。
+*/
+typedef struct ReorderBuffer {
+    FrameMessage* slots;
+    int* filled;
+    int size;
+    int64_t next;        // 下一个待取出的序号
+    int64_t reserved;    // 已申请的序号总数
+    int closed;          // 是否已停止申请新的序号
+    int err;             // 非0时所有操作立即返回该错误
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+}ReorderBuffer;
+
+
+/**
+* 分配一个可容纳size个在途帧的ReorderBuffer。使用结束后需要调用reorder_free释放。
+*/
+int reorder_alloc(ReorderBuffer** buf, int size)
+{
+    ReorderBuffer* rb;
+
+    rb = (ReorderBuffer*)calloc(1, sizeof(ReorderBuffer));
+    if (!rb) {
+        return AVERROR(ENOMEM);
+    }
+    *buf = rb;
+    rb->slots = (FrameMessage*)calloc(size, sizeof(FrameMessage));
+    rb->filled = (int*)calloc(size, sizeof(int));
+    if (!rb->slots || !rb->filled) {
+        return AVERROR(ENOMEM);
+    }
+    rb->size = size;
+    pthread_mutex_init(&rb->mutex, NULL);
+    pthread_cond_init(&rb->cond, NULL);
+
+    return 0;
+}
+
+
+/**
+* 清空ReorderBuffer结构体所关联的内存，包括尚未取出的帧。
+*/
+void reorder_free(ReorderBuffer** buf)
+{
+    if (*buf) {
+        if ((*buf)->slots && (*buf)->filled) {
+            for (int i = 0; i < (*buf)->size; i++) {
+                if ((*buf)->filled[i])
+                    message_free(&(*buf)->slots[i]);
+            }
+            pthread_mutex_destroy(&(*buf)->mutex);
+            pthread_cond_destroy(&(*buf)->cond);
         }
+        free((*buf)->slots);
+        free((*buf)->filled);
+        free(*buf);
+        *buf = NULL;
     }
 }
 
 
 /**
-* 由给定参数创建一个新的滤镜结构体。注意使用结束后需要调用filter_free来释放内存。
+* 申请下一个帧序号。在途帧已占满缓冲区时阻塞，直至编码线程取走最早的帧。
 */
-int create_filter(FilterThreadContext** ctx, char** filters, int count, \
-    char* buf_filter_args, enum AVPixelFormat sink_filter_pix_fmt)
+int reorder_reserve(ReorderBuffer* buf, int64_t* seq)
 {
     int ret = 0;
-    FilterThreadContext* filter_ctx;
-    const AVFilter* buf_filter, * sink_filter;
-    enum AVPixelFormat pixel_fmts[] = {sink_filter_pix_fmt, AV_PIX_FMT_NONE};
-    AVFilterInOut* inputs = NULL, * outputs = NULL;
 
-    // 内存分配
-    filter_ctx = (FilterThreadContext*)malloc(sizeof(FilterThreadContext));
-    if (!filter_ctx) {
-        ret = AVERROR(ENOMEM);
-        goto end;
+    pthread_mutex_lock(&buf->mutex);
+    while (!buf->err && buf->reserved - buf->next >= buf->size) {
+        pthread_cond_wait(&buf->cond, &buf->mutex);
     }
-    *ctx = filter_ctx;
-    filter_ctx->frame = av_frame_alloc();
-    filter_ctx->graph = avfilter_graph_alloc();
-    filter_ctx->buf_filter = NULL;
-    filter_ctx->sink_filter = NULL;
-    filter_ctx->flag = (int*)malloc(sizeof(int));
-    if (!filter_ctx->frame || !filter_ctx->graph || !filter_ctx->flag) {
-        ret = AVERROR(ENOMEM);
-        goto end;
+    if (buf->err) {
+        ret = buf->err;
     }
-
-    // 创建源过滤器和接收过滤器
-    buf_filter = avfilter_get_by_name("buffer");
-    ret = avfilter_graph_create_filter(&filter_ctx->buf_filter, buf_filter, "buffer", buf_filter_args, NULL, filter_ctx->graph);
-    sink_filter = avfilter_get_by_name("buffersink");
-    ret = avfilter_graph_create_filter(&filter_ctx->sink_filter, sink_filter, "buffersink", NULL, NULL, filter_ctx->graph);
-    ret = av_opt_set_int_list(filter_ctx->sink_filter, "pix_fmts", pixel_fmts, AV_PIX_FMT_NONE, AV_OPT_SEARCH_CHILDREN);
-    if (ret < 0 || !filter_ctx->buf_filter || !filter_ctx->sink_filter) {
-        printf("Fail to initialize filter graph.\n");
-        if (ret >= 0) ret = AVERROR(ENOMEM);
-        goto end;
+    else {
+        *seq = buf->reserved++;
     }
+    pthread_mutex_unlock(&buf->mutex);
 
-    // 创建过滤器链接表
-    outputs = avfilter_inout_alloc();
-    inputs = avfilter_inout_alloc();
-    if (outputs && inputs) {
-        outputs->name = av_strdup("in");
-        outputs->filter_ctx = filter_ctx->buf_filter;
-        outputs->pad_idx = 0;
-        outputs->next = NULL;
-        inputs->name = av_strdup("out");
-        inputs->filter_ctx = filter_ctx->sink_filter;
-        inputs->pad_idx = 0;
-        inputs->next = NULL;
+    return ret;
+}
+
+
+/**
+* 将处理结果写入msg->seq对应的槽位。由于序号已预先申请，该操作不会阻塞。
+*/
+int reorder_put(ReorderBuffer* buf, FrameMessage* msg)
+{
+    int ret = 0, idx = (int)(msg->seq % buf->size);
+
+    pthread_mutex_lock(&buf->mutex);
+    if (buf->err) {
+        ret = buf->err;
     }
     else {
-        printf("Fail to initialize filter graph.\n");
-        ret = AVERROR(ENOMEM);
-        goto end;
+        buf->slots[idx] = *msg;
+        buf->filled[idx] = 1;
+        pthread_cond_broadcast(&buf->cond);
     }
+    pthread_mutex_unlock(&buf->mutex);
 
-    // 解析过滤器字符串，并添加过滤器
-    for (int i = 0; i < count; i++) {
-        ret = avfilter_graph_parse_ptr(filter_ctx->graph, filters[i], &inputs, &outputs, NULL);
-        if (ret < 0) {
-            printf("Fail to parse filter '%s'.\n", filters[i]);
-            goto end;
-        }
+    return ret;
+}
+
+
+/**
+* 按序号顺序取出下一个结果。所有已申请的序号均已取出且缓冲区已关闭时返回AVERROR_EOF。
+*/
+int reorder_get(ReorderBuffer* buf, FrameMessage* msg)
+{
+    int ret = 0, idx;
+
+    pthread_mutex_lock(&buf->mutex);
+    idx = (int)(buf->next % buf->size);
+    while (!buf->err && !buf->filled[idx] && !(buf->closed && buf->next == buf->reserved)) {
+        pthread_cond_wait(&buf->cond, &buf->mutex);
+    }
+    if (buf->err) {
+        ret = buf->err;
+    }
+    else if (!buf->filled[idx]) {
+        ret = AVERROR_EOF;
     }
+    else {
+        *msg = buf->slots[idx];
+        buf->filled[idx] = 0;
+        buf->next++;
+        pthread_cond_broadcast(&buf->cond);
+    }
+    pthread_mutex_unlock(&buf->mutex);
 
-    // 验证过滤器链接
-    ret = avfilter_graph_config(filter_ctx->graph, NULL);
-    if (ret < 0) {
-        printf("Fail to verify filter graph.\n");
-        goto end;
+    return ret;
+}
+
+
+/**
+* 停止申请新的序号。err非0时表示发生错误，所有阻塞中的操作都将立即返回err。
+*/
+void reorder_close(ReorderBuffer* buf, int err)
+{
+    pthread_mutex_lock(&buf->mutex);
+    buf->closed = 1;
+    if (err && !buf->err) {
+        buf->err = err;
     }
+    pthread_cond_broadcast(&buf->cond);
+    pthread_mutex_unlock(&buf->mutex);
+}
 
-end:
-    avfilter_inout_free(&outputs);
-    avfilter_inout_free(&inputs);
 
-    return ret;
+/**
+* 各滤镜线程之间传递输出帧的环形缓冲区，供帧间差分使用。每一帧编码前先存入自身序号的槽位，再取走上一序号的帧
+* 作为参考，这样各线程虽然乱序处理，每帧的参考帧仍与顺序处理时相同。每个序号都必须调用一次history_exchange。
+*/
+typedef struct FrameHistory {
+    AVFrame** frames;
+    int64_t* seqs;    // 各槽位所存帧的序号，-1表示空槽位
+    int size;
+    int closed;       // 关闭后阻塞中的操作立即返回，不再提供参考帧
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+}FrameHistory;
+
+
+/**
+* 分配一个含size个槽位的FrameHistory，size应大于在途帧数。使用结束后需要调用history_free释放。
+*/
+int history_alloc(FrameHistory** history, int size)
+{
+    FrameHistory* fh;
+
+    fh = (FrameHistory*)calloc(1, sizeof(FrameHistory));
+    if (!fh) {
+        return AVERROR(ENOMEM);
+    }
+    *history = fh;
+    fh->frames = (AVFrame**)calloc(size, sizeof(AVFrame*));
+    fh->seqs = (int64_t*)malloc(size * sizeof(int64_t));
+    if (!fh->frames || !fh->seqs) {
+        return AVERROR(ENOMEM);
+    }
+    for (int i = 0; i < size; i++) {
+        fh->seqs[i] = -1;
+    }
+    fh->size = size;
+    pthread_mutex_init(&fh->mutex, NULL);
+    pthread_cond_init(&fh->cond, NULL);
+
+    return 0;
 }
 
 
-void* filting(void* arg)
+void history_free(FrameHistory** history)
 {
-    FilterThreadContext* td = (FilterThreadContext*)arg;
-    int64_t pts;
-    int ret;
-    
-    while (1) {
-        while (*td->flag != 1) {
-            if (*td->flag == -1) {
-                pthread_exit(NULL);
+    if (*history) {
+        if ((*history)->frames && (*history)->seqs) {
+            for (int i = 0; i < (*history)->size; i++) {
+                av_frame_free(&(*history)->frames[i]);
             }
-            Sleep(WAIT_TIME);    // 当flag不为±1时等待
-        };
-#ifdef DEBUG
-        printf("Filt-%d:  Receive\n", td->id);
-#endif
-        pts = td->frame->pts;
-        ret = av_buffersrc_add_frame(td->buf_filter, td->frame);
-        ret = av_buffersink_get_frame(td->sink_filter, td->frame);
-        if (ret >= 0) {
-            td->frame->pts = (int64_t)(td->pts_factor * pts);    // 手动设置时间戳
+            pthread_mutex_destroy(&(*history)->mutex);
+            pthread_cond_destroy(&(*history)->cond);
         }
-        *td->flag = ret;
-#ifdef DEBUG
-        printf("Filt-%d: frame %I64d - %s (%d)\n", td->id, td->frame->pts, av_err2str(ret), ret);
-#endif
-        };
-    
-    return NULL;
+        free((*history)->frames);
+        free((*history)->seqs);
+        free(*history);
+        *history = NULL;
+    }
 }
 
 
 /**
-* 用于传递gif转码配置的便利结构体。
+* 存入序号为seq的输出帧frame（为空表示该帧处理失败），然后等待并取走序号为seq-1的帧，存入prev。
+* seq为0、上一帧处理失败或缓冲区已关闭时prev为空。frame的所有权转移给缓冲区，prev则需由调用者释放。
 */
-typedef struct ConfigureData {
-    float scale;
-    float speed;
-    int fps;
-    int depth;
-    int thread;
-}ConfigureData;
+void history_exchange(FrameHistory* history, int64_t seq, AVFrame* frame, AVFrame** prev)
+{
+    int idx = (int)(seq % history->size), prev_idx = (int)((seq + history->size - 1) % history->size);
+
+    *prev = NULL;
+    pthread_mutex_lock(&history->mutex);
+    // 槽位仍被更早的帧占用时，等待其被下一帧取走
+    while (!history->closed && history->seqs[idx] >= 0) {
+        pthread_cond_wait(&history->cond, &history->mutex);
+    }
+    if (history->closed) {
+        pthread_mutex_unlock(&history->mutex);
+        av_frame_free(&frame);
+        return;
+    }
+    history->frames[idx] = frame;
+    history->seqs[idx] = seq;
+    pthread_cond_broadcast(&history->cond);
+    while (seq > 0 && !history->closed && history->seqs[prev_idx] != seq - 1) {
+        pthread_cond_wait(&history->cond, &history->mutex);
+    }
+    if (seq > 0 && history->seqs[prev_idx] == seq - 1) {
+        *prev = history->frames[prev_idx];
+        history->frames[prev_idx] = NULL;
+        history->seqs[prev_idx] = -1;
+        pthread_cond_broadcast(&history->cond);
+    }
+    pthread_mutex_unlock(&history->mutex);
+}
+
+
+/**
+* 关闭缓冲区，使所有阻塞中的history_exchange立即返回。流水线出错中止时，部分序号可能永远不会被存入。
+*/
+void history_close(FrameHistory* history)
+{
+    pthread_mutex_lock(&history->mutex);
+    history->closed = 1;
+    pthread_cond_broadcast(&history->cond);
+    pthread_mutex_unlock(&history->mutex);
+}
+
+
+/**
+* 抖动方式，与paletteuse的dither选项对应。
+*/
+enum DitherMode {
+    DITHER_NONE,               // 不抖动
+    DITHER_BAYER,              // 8x8 Bayer有序抖动
+    DITHER_SIERRA,             // Sierra Lite误差扩散（sierra2_4a，paletteuse的默认方式）
+    DITHER_FLOYD_STEINBERG     // Floyd-Steinberg误差扩散
+};
+
+
+/**
+* 颜色映射器，为每个像素查找调色板中与其最接近的颜色（RGB空间的欧氏距离，距离相同时取序号较小者）。
+* 将RGB空间按每通道高6位划分为64x64x64个格子，查找表中记录每个格子的结果：格子内只可能有一个最近颜色时
+* 直接记录其序号，否则在pool中为格子内全部4x4x4个颜色逐一计算结果，记录该结果块的位置（LUT_BLOCK+offset）。
+* 格子在首次被访问时才计算，此后每个像素的查找都只需读表；计算格子时只需检查其所在粗分区的候选颜色。
+*/
+typedef struct ColorMapper {
+    uint32_t palette[256];
+    int32_t lut[262144];
+    int32_t coarse[4096];    // 16x16x16粗分区的候选列表在cand中的位置
+    uint8_t* pool;    // 结果块，末尾保留3字节以便按32位读取
+    uint8_t* cand;
+    int pool_size, pool_used;
+    int cand_size, cand_used;
+    enum DitherMode dither;
+    int dither_threads;   // 误差扩散时一帧内并行处理的线程数
+    struct DiffusePool* diffuser;    // 并行误差扩散的常驻线程，由diffuser_start启动
+    int8_t bayer[64];     // 8x8 Bayer矩阵对应的各像素偏移量
+    uint32_t* row;        // 有序抖动后的行缓存
+    int16_t* error;       // 误差扩散的当前行与下一行误差，每行(width + 2) * 3个
+    int row_width;
+    void (*map_row)(struct ColorMapper* mapper, const uint32_t* src, uint8_t* dst, int width);
+    void (*bayer_row)(const int8_t* delta, const uint32_t* src, uint32_t* dst, int width);
+}ColorMapper;
+
+
+#define LUT_CELL(p) ((((p) >> 6) & 0x3F000) | (((p) >> 4) & 0xFC0) | (((p) >> 2) & 0x3F))
+#define LUT_SUB(p) ((((p) >> 12) & 0x30) | (((p) >> 6) & 0xC) | ((p) & 0x3))    // 像素在结果块中的位置
+
+
+static inline int color_distance(uint32_t a, uint32_t b)
+{
+    int dr = (int)(a >> 16 & 0xFF) - (int)(b >> 16 & 0xFF);
+    int dg = (int)(a >> 8 & 0xFF) - (int)(b >> 8 & 0xFF);
+    int db = (int)(a & 0xFF) - (int)(b & 0xFF);
+
+    return dr * dr + dg * dg + db * db;
+}
+
+
+static inline uint8_t clip_pixel(int v)
+{
+    return (uint8_t)((v < 0) ? 0 : (v > 255) ? 255 : v);
+}
+
+
+/**
+* 调色板中的颜色是否参与匹配。透明色只用于表示透明像素。
+*/
+static inline int color_opaque(const ColorMapper* mapper, int i)
+{
+    return (mapper->palette[i] >> 24) >= 128;
+}
+
+
+/**
+* 从from中的n个颜色里筛选出可能是边长为side、起点为lo的立方体内某点最近颜色者，写入out并返回其个数：
+* 与立方体的最小距离不超过所有颜色到立方体最大距离中的最小值者才可能成为最近颜色。筛选结果保持序号顺序。
+*/
+int find_candidates(const ColorMapper* mapper, const int* lo, int side, const uint8_t* from, int n, uint8_t* out)
+{
+    int c[3], dmin[256], dmax, limit = INT_MAX, count = 0;
+
+    for (int i = 0; i < n; i++) {
+        c[0] = mapper->palette[from[i]] >> 16 & 0xFF;
+        c[1] = mapper->palette[from[i]] >> 8 & 0xFF;
+        c[2] = mapper->palette[from[i]] & 0xFF;
+        dmin[i] = dmax = 0;
+        for (int k = 0; k < 3; k++) {
+            int d_lo = c[k] - lo[k], d_hi = c[k] - (lo[k] + side - 1);
+            int near = (d_lo < 0) ? d_lo : (d_hi > 0) ? d_hi : 0;
+            int far = FFMAX(FFABS(d_lo), FFABS(d_hi));
+            dmin[i] += near * near;
+            dmax += far * far;
+        }
+        limit = FFMIN(limit, dmax);
+    }
+    for (int i = 0; i < n; i++) {
+        if (dmin[i] <= limit) {
+            out[count++] = from[i];
+        }
+    }
+
+    return count;
+}
+
+
+/**
+* 返回格子所在的16x16x16粗分区的候选列表（首字节为候选数减1），粗分区在首次被访问时计算。
+* 调色板中没有不透明颜色时返回NULL。
+*/
+const uint8_t* coarse_candidates(ColorMapper* mapper, int cell)
+{
+    int region = (cell >> 6 & 0xF00) | (cell >> 4 & 0xF0) | (cell >> 2 & 0xF), lo[3], n = 0, size;
+    uint8_t opaque[256], list[256], * pool;
+
+    if (mapper->coarse[region] != LUT_UNBUILT) {
+        return mapper->cand + mapper->coarse[region];
+    }
+    for (int i = 0; i < 256; i++) {
+        if (color_opaque(mapper, i))
+            opaque[n++] = (uint8_t)i;
+    }
+    if (!n) {
+        return NULL;
+    }
+    lo[0] = (region >> 8 & 0xF) << 4;
+    lo[1] = (region >> 4 & 0xF) << 4;
+    lo[2] = (region & 0xF) << 4;
+    n = find_candidates(mapper, lo, 16, opaque, n, list);
+    if (mapper->cand_used + n + 1 > mapper->cand_size) {
+        size = FFMAX(mapper->cand_size * 2, 65536);
+        pool = (uint8_t*)av_realloc(mapper->cand, size);
+        if (!pool) {
+            return NULL;
+        }
+        mapper->cand = pool;
+        mapper->cand_size = size;
+    }
+    pool = mapper->cand + mapper->cand_used;
+    pool[0] = (uint8_t)(n - 1);
+    memcpy(pool + 1, list, n);
+    mapper->coarse[region] = mapper->cand_used;
+    mapper->cand_used += n + 1;
+
+    return pool;
+}
+
+
+/**
+* 计算一个格子的查找表项。候选只从粗分区的候选列表中筛选；多于一个时，在候选中为格子内每个颜色精确查找，写入结果块。
+*/
+int build_cell(ColorMapper* mapper, int cell)
+{
+    int lo[3], n, size;
+    uint8_t candidates[256], * block;
+    const uint8_t* coarse;
+
+    coarse = coarse_candidates(mapper, cell);
+    if (!coarse) {
+        mapper->lut[cell] = 0;    // 调色板中没有不透明颜色，或内存不足
+        return 0;
+    }
+    lo[0] = (cell >> 12 & 0x3F) << 2;
+    lo[1] = (cell >> 6 & 0x3F) << 2;
+    lo[2] = (cell & 0x3F) << 2;
+    n = find_candidates(mapper, lo, 4, coarse + 1, coarse[0] + 1, candidates);
+    if (n == 1) {
+        mapper->lut[cell] = candidates[0];
+        return mapper->lut[cell];
+    }
+
+    // 多个候选时计算结果块
+    if (mapper->pool_used + 64 + 3 > mapper->pool_size) {
+        size = FFMAX(mapper->pool_size * 2, 65536);
+        block = (uint8_t*)av_realloc(mapper->pool, size);
+        if (!block) {
+            mapper->lut[cell] = candidates[0];    // 内存不足时退化为近似结果
+            return mapper->lut[cell];
+        }
+        mapper->pool = block;
+        mapper->pool_size = size;
+    }
+    block = mapper->pool + mapper->pool_used;
+    for (int sub = 0; sub < 64; sub++) {
+        uint32_t color = (uint32_t)(lo[0] + (sub >> 4 & 3)) << 16 | (uint32_t)(lo[1] + (sub >> 2 & 3)) << 8 | \
+            (uint32_t)(lo[2] + (sub & 3));
+        int best = candidates[0], best_d = INT_MAX, d;
+        for (int k = 0; k < n; k++) {
+            d = color_distance(color, mapper->palette[candidates[k]]);
+            if (d < best_d) {
+                best_d = d;
+                best = candidates[k];
+            }
+        }
+        block[sub] = (uint8_t)best;
+    }
+    mapper->lut[cell] = LUT_BLOCK + mapper->pool_used;
+    mapper->pool_used += 64;
+
+    return mapper->lut[cell];
+}
+
+
+static inline uint8_t lookup_color(ColorMapper* mapper, uint32_t color)
+{
+    int32_t entry = mapper->lut[LUT_CELL(color)];
+
+    if (entry == LUT_UNBUILT) {
+        entry = build_cell(mapper, LUT_CELL(color));
+    }
+
+    return (entry < LUT_BLOCK) ? (uint8_t)entry : mapper->pool[entry - LUT_BLOCK + LUT_SUB(color)];
+}
+
+
+void map_row_c(ColorMapper* mapper, const uint32_t* src, uint8_t* dst, int width)
+{
+    for (int x = 0; x < width; x++) {
+        dst[x] = lookup_color(mapper, src[x]);
+    }
+}
+
+
+__attribute__((target("sse4.1")))
+void map_row_sse4(ColorMapper* mapper, const uint32_t* src, uint8_t* dst, int width)
+{
+    const __m128i mask_r = _mm_set1_epi32(0x3F000), mask_g = _mm_set1_epi32(0xFC0), mask_b = _mm_set1_epi32(0x3F);
+    __m128i p, cell;
+    int x = 0;
+
+    for (; x + 4 <= width; x += 4) {
+        p = _mm_loadu_si128((const __m128i*)(src + x));
+        cell = _mm_or_si128(_mm_or_si128(_mm_and_si128(_mm_srli_epi32(p, 6), mask_r), \
+            _mm_and_si128(_mm_srli_epi32(p, 4), mask_g)), _mm_and_si128(_mm_srli_epi32(p, 2), mask_b));
+        // 没有gather指令，格子序号的计算向量化，查表逐个进行
+        for (int k = 0; k < 4; k++) {
+            int32_t entry = mapper->lut[_mm_extract_epi32(cell, 0)];
+            if (entry == LUT_UNBUILT) {
+                entry = build_cell(mapper, _mm_extract_epi32(cell, 0));
+            }
+            dst[x + k] = (entry < LUT_BLOCK) ? (uint8_t)entry : mapper->pool[entry - LUT_BLOCK + LUT_SUB(src[x + k])];
+            cell = _mm_srli_si128(cell, 4);
+        }
+    }
+    map_row_c(mapper, src + x, dst + x, width - x);
+}
+
+
+__attribute__((target("avx2")))
+void map_row_avx2(ColorMapper* mapper, const uint32_t* src, uint8_t* dst, int width)
+{
+    const __m256i mask_r = _mm256_set1_epi32(0x3F000), mask_g = _mm256_set1_epi32(0xFC0), mask_b = _mm256_set1_epi32(0x3F);
+    const __m256i sub_r = _mm256_set1_epi32(0x30), sub_g = _mm256_set1_epi32(0xC), sub_b = _mm256_set1_epi32(0x3);
+    const __m256i block = _mm256_set1_epi32(LUT_BLOCK - 1), low = _mm256_set1_epi32(0xFF);
+    __m256i p, cell, sub, entry, is_block;
+    int x = 0;
+
+    for (; x + 8 <= width; x += 8) {
+        p = _mm256_loadu_si256((const __m256i*)(src + x));
+        cell = _mm256_or_si256(_mm256_or_si256(_mm256_and_si256(_mm256_srli_epi32(p, 6), mask_r), \
+            _mm256_and_si256(_mm256_srli_epi32(p, 4), mask_g)), _mm256_and_si256(_mm256_srli_epi32(p, 2), mask_b));
+        entry = _mm256_i32gather_epi32((const int*)mapper->lut, cell, 4);
+        if (_mm256_movemask_ps(_mm256_castsi256_ps(entry))) {
+            // 有尚未计算的格子
+            map_row_c(mapper, src + x, dst + x, 8);
+            continue;
+        }
+        // 结果块中的项再按字节偏移读取一次，取低8位
+        is_block = _mm256_cmpgt_epi32(entry, block);
+        if (!_mm256_testz_si256(is_block, is_block)) {
+            sub = _mm256_or_si256(_mm256_or_si256(_mm256_and_si256(_mm256_srli_epi32(p, 12), sub_r), \
+                _mm256_and_si256(_mm256_srli_epi32(p, 6), sub_g)), _mm256_and_si256(p, sub_b));
+            sub = _mm256_add_epi32(_mm256_sub_epi32(entry, _mm256_set1_epi32(LUT_BLOCK)), sub);
+            entry = _mm256_mask_i32gather_epi32(entry, (const int*)mapper->pool, sub, is_block, 1);
+            entry = _mm256_and_si256(entry, low);
+        }
+        // 每128位通道内各自压缩，低4字节分别为前4个与后4个结果
+        entry = _mm256_packus_epi16(_mm256_packus_epi32(entry, entry), entry);
+        *(int32_t*)(dst + x) = _mm_cvtsi128_si32(_mm256_castsi256_si128(entry));
+        *(int32_t*)(dst + x + 4) = _mm_cvtsi128_si32(_mm256_extracti128_si256(entry, 1));
+    }
+    map_row_c(mapper, src + x, dst + x, width - x);
+}
+
+
+/**
+* 为一行像素的各通道加上Bayer矩阵中该行的偏移量delta（8个，按x & 7循环），结果饱和到0~255。
+*/
+void bayer_row_c(const int8_t* delta, const uint32_t* src, uint32_t* dst, int width)
+{
+    uint32_t p;
+    int d;
+
+    for (int x = 0; x < width; x++) {
+        p = src[x];
+        d = delta[x & 7];
+        dst[x] = (p & 0xFF000000) | (uint32_t)clip_pixel((int)(p >> 16 & 0xFF) + d) << 16 | \
+            (uint32_t)clip_pixel((int)(p >> 8 & 0xFF) + d) << 8 | clip_pixel((int)(p & 0xFF) + d);
+    }
+}
+
+
+__attribute__((target("sse4.1")))
+void bayer_row_sse4(const int8_t* delta, const uint32_t* src, uint32_t* dst, int width)
+{
+    __m128i pos[2], neg[2], p;
+    int x = 0;
+
+    // 正负偏移分别做饱和加减，Alpha通道不变；4个像素一组，两组交替
+    for (int k = 0; k < 2; k++) {
+        uint8_t up[16] = { 0 }, down[16] = { 0 };
+        for (int i = 0; i < 4; i++) {
+            int d = delta[4 * k + i];
+            memset(up + 4 * i, d > 0 ? d : 0, 3);
+            memset(down + 4 * i, d < 0 ? -d : 0, 3);
+        }
+        pos[k] = _mm_loadu_si128((const __m128i*)up);
+        neg[k] = _mm_loadu_si128((const __m128i*)down);
+    }
+    for (; x + 4 <= width; x += 4) {
+        p = _mm_loadu_si128((const __m128i*)(src + x));
+        p = _mm_subs_epu8(_mm_adds_epu8(p, pos[(x >> 2) & 1]), neg[(x >> 2) & 1]);
+        _mm_storeu_si128((__m128i*)(dst + x), p);
+    }
+    for (; x < width; x++) {
+        bayer_row_c(delta + (x & 7), src + x, dst + x, 1);
+    }
+}
+
+
+__attribute__((target("avx2")))
+void bayer_row_avx2(const int8_t* delta, const uint32_t* src, uint32_t* dst, int width)
+{
+    uint8_t up[32] = { 0 }, down[32] = { 0 };
+    __m256i pos, neg, p;
+    int x = 0;
+
+    for (int i = 0; i < 8; i++) {
+        memset(up + 4 * i, delta[i] > 0 ? delta[i] : 0, 3);
+        memset(down + 4 * i, delta[i] < 0 ? -delta[i] : 0, 3);
+    }
+    pos = _mm256_loadu_si256((const __m256i*)up);
+    neg = _mm256_loadu_si256((const __m256i*)down);
+    for (; x + 8 <= width; x += 8) {
+        p = _mm256_loadu_si256((const __m256i*)(src + x));
+        p = _mm256_subs_epu8(_mm256_adds_epu8(p, pos), neg);
+        _mm256_storeu_si256((__m256i*)(dst + x), p);
+    }
+    for (; x < width; x++) {
+        bayer_row_c(delta + (x & 7), src + x, dst + x, 1);
+    }
+}
+
+
+/**
+* 分配一个新的颜色映射器，根据CPU支持的指令集选择实现。使用结束后需要调用mapper_free释放。
+*/
+ColorMapper* mapper_alloc()
+{
+    ColorMapper* mapper;
+    int flags = av_get_cpu_flags();
+
+    mapper = (ColorMapper*)av_mallocz(sizeof(ColorMapper));
+    if (mapper) {
+        memset(mapper->lut, 0xFF, sizeof(mapper->lut));    // 全部为LUT_UNBUILT
+        memset(mapper->coarse, 0xFF, sizeof(mapper->coarse));
+        if (flags & AV_CPU_FLAG_AVX2) {
+            mapper->map_row = map_row_avx2;
+            mapper->bayer_row = bayer_row_avx2;
+        }
+        else if (flags & AV_CPU_FLAG_SSE4) {
+            mapper->map_row = map_row_sse4;
+            mapper->bayer_row = bayer_row_sse4;
+        }
+        else {
+            mapper->map_row = map_row_c;
+            mapper->bayer_row = bayer_row_c;
+        }
+    }
+
+    return mapper;
+}
+
+
+/**
+* 设置调色板。调色板改变时清空查找表。
+*/
+void mapper_set_palette(ColorMapper* mapper, const uint32_t* palette)
+{
+    if (memcmp(mapper->palette, palette, sizeof(mapper->palette))) {
+        memcpy(mapper->palette, palette, sizeof(mapper->palette));
+        memset(mapper->lut, 0xFF, sizeof(mapper->lut));
+        memset(mapper->coarse, 0xFF, sizeof(mapper->coarse));
+        mapper->pool_used = 0;
+        mapper->cand_used = 0;
+    }
+}
+
+
+/**
+* 设置抖动方式。bayer_scale与paletteuse的同名选项含义相同，越大抖动越弱；threads大于1时，
+* 再调用diffuser_start启动线程池，误差扩散即按波前方式由多个线程并行处理一帧。
+*/
+void mapper_set_dither(ColorMapper* mapper, enum DitherMode dither, int bayer_scale, int threads)
+{
+    int q, m;
+
+    mapper->dither = dither;
+    mapper->dither_threads = FFMAX(threads, 1);
+    bayer_scale = av_clip(bayer_scale, 0, 5);
+    for (int i = 0; i < 64; i++) {
+        // 由行列序号的位交织得到8x8 Bayer矩阵（0~63），与paletteuse的dither_value相同，再居中并按bayer_scale缩小
+        q = i ^ (i >> 3);
+        m = (i & 4) >> 2 | (q & 4) >> 1 | (i & 2) << 1 | (q & 2) << 2 | (i & 1) << 4 | (q & 1) << 5;
+        mapper->bayer[i] = (int8_t)((m >> bayer_scale) - (32 >> bayer_scale));
+    }
+}
+
+
+/**
+* 误差扩散：将像素的量化误差按权重分配给右侧与下一行的相邻像素。err为当前行误差，next为下一行误差，
+* 两者都以像素x + 1为下标，两端各留一个像素的空间。
+*/
+static inline void diffuse_error(enum DitherMode dither, int16_t* err, int16_t* next, int x, const int* e)
+{
+    for (int k = 0; k < 3; k++) {
+        if (dither == DITHER_FLOYD_STEINBERG) {
+            err[3 * (x + 2) + k] += e[k] * 7 / 16;
+            next[3 * x + k] += e[k] * 3 / 16;
+            next[3 * (x + 1) + k] += e[k] * 5 / 16;
+            next[3 * (x + 2) + k] += e[k] / 16;
+        }
+        else {
+            err[3 * (x + 2) + k] += e[k] / 2;
+            next[3 * x + k] += e[k] / 4;
+            next[3 * (x + 1) + k] += e[k] / 4;
+        }
+    }
+}
+
+
+/**
+* 不使用查找表中尚未计算的格子，直接在粗分区的候选颜色中查找最近颜色，结果与lookup_color相同。
+* 不修改映射器，粗分区须已由mapper_prepare全部计算，因此可由多个线程同时调用。
+*/
+static inline uint8_t peek_color(const ColorMapper* mapper, uint32_t color)
+{
+    int32_t entry = mapper->lut[LUT_CELL(color)];
+    int region, best = 0, best_d = INT_MAX, d;
+    const uint8_t* list;
+
+    if (entry != LUT_UNBUILT) {
+        return (entry < LUT_BLOCK) ? (uint8_t)entry : mapper->pool[entry - LUT_BLOCK + LUT_SUB(color)];
+    }
+    region = ((color >> 12) & 0xF00) | ((color >> 8) & 0xF0) | ((color >> 4) & 0xF);
+    if (mapper->coarse[region] == LUT_UNBUILT) {
+        return 0;    // 调色板中没有不透明颜色
+    }
+    list = mapper->cand + mapper->coarse[region];
+    for (int k = 1; k <= list[0] + 1; k++) {
+        d = color_distance(color, mapper->palette[list[k]]);
+        if (d < best_d) {
+            best_d = d;
+            best = list[k];
+        }
+    }
+
+    return (uint8_t)best;
+}
+
+
+/**
+* 计算全部粗分区的候选列表，此后peek_color不会再修改映射器。
+*/
+void mapper_prepare(ColorMapper* mapper)
+{
+    for (int r = 0; r < 16; r++) {
+        for (int g = 0; g < 16; g++) {
+            for (int b = 0; b < 16; b++) {
+                coarse_candidates(mapper, (r << 14) | (g << 8) | (b << 2));
+            }
+        }
+    }
+}
+
+
+/**
+* 按误差扩散的方式映射一行中[x0, x1)范围的像素，err与next的含义同diffuse_error。
+* shared非0时由多个线程同时处理，只使用peek_color查找而不计算新的格子。
+*/
+void diffuse_row(ColorMapper* mapper, const uint32_t* src, uint8_t* dst, int x0, int x1, int16_t* err, int16_t* next, \
+    int shared)
+{
+    int c[3], e[3];
+    uint32_t color, pal;
+
+    for (int x = x0; x < x1; x++) {
+        c[0] = clip_pixel((int)(src[x] >> 16 & 0xFF) + err[3 * (x + 1)]);
+        c[1] = clip_pixel((int)(src[x] >> 8 & 0xFF) + err[3 * (x + 1) + 1]);
+        c[2] = clip_pixel((int)(src[x] & 0xFF) + err[3 * (x + 1) + 2]);
+        color = (src[x] & 0xFF000000) | (uint32_t)c[0] << 16 | (uint32_t)c[1] << 8 | c[2];
+        dst[x] = shared ? peek_color(mapper, color) : lookup_color(mapper, color);
+        pal = mapper->palette[dst[x]];
+        e[0] = c[0] - (int)(pal >> 16 & 0xFF);
+        e[1] = c[1] - (int)(pal >> 8 & 0xFF);
+        e[2] = c[2] - (int)(pal & 0xFF);
+        diffuse_error(mapper->dither, err, next, x, e);
+    }
+}
+
+
+/**
+* 按设置的抖动方式映射图像的第y行。误差扩散要求从第0行开始依次调用。
+*/
+int dither_row(ColorMapper* mapper, const uint32_t* src, uint8_t* dst, int width, int y)
+{
+    int16_t* err, * next;
+
+    if (mapper->dither == DITHER_NONE) {
+        mapper->map_row(mapper, src, dst, width);
+        return 0;
+    }
+    if (width > mapper->row_width) {
+        av_freep(&mapper->row);
+        av_freep(&mapper->error);
+        mapper->row = (uint32_t*)av_malloc_array(width, sizeof(uint32_t));
+        mapper->error = (int16_t*)av_calloc(2 * (width + 2) * 3, sizeof(int16_t));
+        mapper->row_width = (mapper->row && mapper->error) ? width : 0;
+        if (!mapper->row_width) {
+            return AVERROR(ENOMEM);
+        }
+    }
+    if (mapper->dither == DITHER_BAYER) {
+        mapper->bayer_row(mapper->bayer + 8 * (y & 7), src, mapper->row, width);
+        mapper->map_row(mapper, mapper->row, dst, width);
+        return 0;
+    }
+
+    // 两行误差交替使用，第0行开始时清空
+    err = mapper->error + (y & 1) * (mapper->row_width + 2) * 3;
+    next = mapper->error + ((y + 1) & 1) * (mapper->row_width + 2) * 3;
+    if (y == 0) {
+        memset(err, 0, (mapper->row_width + 2) * 3 * sizeof(int16_t));
+    }
+    memset(next, 0, (mapper->row_width + 2) * 3 * sizeof(int16_t));
+    diffuse_row(mapper, src, dst, 0, width, err, next, 0);
+
+    return 0;
+}
+
+
+typedef struct DiffuseContext {
+    ColorMapper* mapper;
+    const AVFrame* rgb;
+    AVFrame* out;
+    int16_t* error;
+    int row_size;
+    int ring;
+    int* progress;
+    int thread_n;
+}DiffuseContext;
+
+
+typedef struct DiffuseJob {
+    struct DiffusePool* pool;
+    int id;
+}DiffuseJob;
+
+
+/**
+* 并行误差扩散的常驻线程池。每个颜色映射器在设置抖动方式后启动一次，此后各帧都由这些线程处理，
+* 调用diffuse_frame的线程自身承担第0组行。误差与进度缓存在各帧之间复用。
+*/
+typedef struct DiffusePool {
+    DiffuseContext ctx;    // 当前帧的任务
+    DiffuseJob* jobs;
+    pthread_t* threads;
+    int thread_n;          // 常驻线程数，不含调用线程
+    int64_t generation;    // 每送出一帧加1，线程据此判断是否有新任务
+    int pending;           // 尚未完成当前帧的常驻线程数
+    int quit;
+    size_t error_size;
+    size_t progress_size;
+    pthread_mutex_t mutex;
+    pthread_cond_t start_cond;
+    pthread_cond_t done_cond;
+}DiffusePool;
+
+
+/**
+* 波前并行误差扩散：第id组依次处理第id、id + thread_n……行；每处理一段像素前，
+* 等待上一行领先该段末尾2个像素以上，此时该段所需的误差都已累加完毕，且两行不会同时写同一位置，
+* 因此结果与串行处理完全相同。
+*/
+void diffuse_rows(DiffuseContext* ctx, int id)
+{
+    int width = ctx->rgb->width, x1, need;
+    int16_t* err, * next;
+
+    for (int y = id; y < ctx->rgb->height; y += ctx->thread_n) {
+        err = ctx->error + (y % ctx->ring) * ctx->row_size;
+        next = ctx->error + ((y + 1) % ctx->ring) * ctx->row_size;
+        for (int x0 = 0; x0 < width; x0 = x1) {
+            x1 = FFMIN(x0 + DIFFUSE_CHUNK, width);
+            need = FFMIN(x1 + 2, width);
+            for (int spin = 0; y > 0 && __atomic_load_n(&ctx->progress[y - 1], __ATOMIC_ACQUIRE) < need; spin++) {
+                if (spin & 0x3F)
+                    _mm_pause();
+                else
+                    sched_yield();
+            }
+            diffuse_row(ctx->mapper, (const uint32_t*)(ctx->rgb->data[0] + y * ctx->rgb->linesize[0]), \
+                ctx->out->data[0] + y * ctx->out->linesize[0], x0, x1, err, next, 1);
+            __atomic_store_n(&ctx->progress[y], x1, __ATOMIC_RELEASE);
+        }
+        // 本行的误差缓存将由本组的下一行（y + thread_n）作为其下一行的缓存使用
+        memset(err, 0, ctx->row_size * sizeof(int16_t));
+    }
+}
+
+
+/**
+* 常驻线程的线程函数：等待新的一帧，处理完本组的行后通知调用线程，直到线程池关闭。
+*/
+void* diffusing(void* arg)
+{
+    DiffuseJob* job = (DiffuseJob*)arg;
+    DiffusePool* pool = job->pool;
+    int64_t seen = 0;
+
+    pthread_mutex_lock(&pool->mutex);
+    while (1) {
+        while (!pool->quit && pool->generation == seen) {
+            pthread_cond_wait(&pool->start_cond, &pool->mutex);
+        }
+        if (pool->quit) {
+            break;
+        }
+        seen = pool->generation;
+        pthread_mutex_unlock(&pool->mutex);
+        diffuse_rows(&pool->ctx, job->id);
+        pthread_mutex_lock(&pool->mutex);
+        if (--pool->pending == 0) {
+            pthread_cond_signal(&pool->done_cond);
+        }
+    }
+    pthread_mutex_unlock(&pool->mutex);
+
+    return NULL;
+}
+
+
+/**
+* 关闭颜色映射器的误差扩散线程池，等待所有线程退出。
+*/
+void diffuser_stop(ColorMapper* mapper)
+{
+    DiffusePool* pool = mapper->diffuser;
+
+    if (!pool) {
+        return;
+    }
+    pthread_mutex_lock(&pool->mutex);
+    pool->quit = 1;
+    pthread_cond_broadcast(&pool->start_cond);
+    pthread_mutex_unlock(&pool->mutex);
+    for (int i = 0; i < pool->thread_n; i++) {
+        pthread_join(pool->threads[i], NULL);
+    }
+    pthread_mutex_destroy(&pool->mutex);
+    pthread_cond_destroy(&pool->start_cond);
+    pthread_cond_destroy(&pool->done_cond);
+    av_free(pool->ctx.error);
+    av_free(pool->ctx.progress);
+    av_free(pool->jobs);
+    av_free(pool->threads);
+    av_freep(&mapper->diffuser);
+}
+
+
+/**
+* 按颜色映射器当前的抖动设置启动误差扩散线程池（dither_threads - 1个常驻线程），已有的线程池先关闭。
+* 不使用误差扩散或只用一个线程时不启动；线程创建失败时按已启动的线程数工作，一个也没有时退回串行处理。
+*/
+int diffuser_start(ColorMapper* mapper)
+{
+    DiffusePool* pool;
+    int n = mapper->dither_threads - 1;
+
+    diffuser_stop(mapper);
+    if ((mapper->dither != DITHER_SIERRA && mapper->dither != DITHER_FLOYD_STEINBERG) || n <= 0) {
+        return 0;
+    }
+    pool = (DiffusePool*)av_mallocz(sizeof(DiffusePool));
+    if (!pool) {
+        return AVERROR(ENOMEM);
+    }
+    pool->jobs = (DiffuseJob*)av_calloc(n, sizeof(DiffuseJob));
+    pool->threads = (pthread_t*)av_calloc(n, sizeof(pthread_t));
+    if (!pool->jobs || !pool->threads) {
+        av_free(pool->jobs);
+        av_free(pool->threads);
+        av_free(pool);
+        return AVERROR(ENOMEM);
+    }
+    pthread_mutex_init(&pool->mutex, NULL);
+    pthread_cond_init(&pool->start_cond, NULL);
+    pthread_cond_init(&pool->done_cond, NULL);
+    mapper->diffuser = pool;
+    for (int i = 0; i < n; i++) {
+        pool->jobs[i].pool = pool;
+        pool->jobs[i].id = i + 1;
+        if (pthread_create(&pool->threads[i], NULL, diffusing, &pool->jobs[i])) {
+            break;
+        }
+        pool->thread_n++;
+    }
+    mapper->dither_threads = pool->thread_n + 1;
+    if (!pool->thread_n) {
+        diffuser_stop(mapper);
+        return AVERROR(EAGAIN);
+    }
+
+    return 0;
+}
+
+
+void mapper_free(ColorMapper** mapper)
+{
+    if (*mapper) {
+        diffuser_stop(*mapper);
+        av_freep(&(*mapper)->pool);
+        av_freep(&(*mapper)->cand);
+        av_freep(&(*mapper)->row);
+        av_freep(&(*mapper)->error);
+        av_freep(mapper);
+    }
+}
+
+
+/**
+* 由线程池以波前方式对整帧做误差扩散，结果与逐行串行处理相同。先不抖动地映射一遍以计算常用的格子，
+* 并计算全部粗分区，之后各线程只读取映射器。没有线程池时返回AVERROR(EAGAIN)，由调用者串行处理。
+*/
+int diffuse_frame(ColorMapper* mapper, const AVFrame* rgb, AVFrame* out)
+{
+    DiffusePool* pool = mapper->diffuser;
+    DiffuseContext* ctx;
+    size_t error_size, progress_size;
+
+    if (!pool) {
+        return AVERROR(EAGAIN);
+    }
+    ctx = &pool->ctx;
+    ctx->thread_n = pool->thread_n + 1;
+    ctx->ring = ctx->thread_n + 1;
+    ctx->row_size = (rgb->width + 2) * 3;
+    error_size = (size_t)ctx->ring * ctx->row_size * sizeof(int16_t);
+    progress_size = (size_t)rgb->height * sizeof(int);
+    if (error_size > pool->error_size) {
+        av_freep(&ctx->error);
+        ctx->error = (int16_t*)av_malloc(error_size);
+        pool->error_size = ctx->error ? error_size : 0;
+    }
+    if (progress_size > pool->progress_size) {
+        av_freep(&ctx->progress);
+        ctx->progress = (int*)av_malloc(progress_size);
+        pool->progress_size = ctx->progress ? progress_size : 0;
+    }
+    if (!ctx->error || !ctx->progress) {
+        return AVERROR(ENOMEM);
+    }
+    memset(ctx->error, 0, error_size);
+    memset(ctx->progress, 0, progress_size);
+
+    for (int y = 0; y < rgb->height; y++) {
+        mapper->map_row(mapper, (const uint32_t*)(rgb->data[0] + y * rgb->linesize[0]), \
+            out->data[0] + y * out->linesize[0], rgb->width);
+    }
+    mapper_prepare(mapper);
+    ctx->mapper = mapper;
+    ctx->rgb = rgb;
+    ctx->out = out;
+
+    // 唤醒常驻线程，本线程处理第0组行，再等待其余各组完成
+    pthread_mutex_lock(&pool->mutex);
+    pool->pending = pool->thread_n;
+    pool->generation++;
+    pthread_cond_broadcast(&pool->start_cond);
+    pthread_mutex_unlock(&pool->mutex);
+    diffuse_rows(ctx, 0);
+    pthread_mutex_lock(&pool->mutex);
+    while (pool->pending > 0) {
+        pthread_cond_wait(&pool->done_cond, &pool->mutex);
+    }
+    pthread_mutex_unlock(&pool->mutex);
+
+    return 0;
+}
+
+
+/**
+* 取出调色板图像（palettegen输出的16x16 RGB32图像）中的256个颜色。
+*/
+void palette_colors(const AVFrame* palette, uint32_t* colors)
+{
+    for (int y = 0; y < 16; y++) {
+        memcpy(colors + 16 * y, palette->data[0] + y * palette->linesize[0], 16 * sizeof(uint32_t));
+    }
+}
+
+
+/**
+* 将RGB32图像rgb按调色板colors映射为PAL8图像，写入新分配的out中。
+*/
+int map_frame(ColorMapper* mapper, const AVFrame* rgb, const uint32_t* colors, AVFrame** out)
+{
+    int ret, parallel;
+    AVFrame* frame;
+
+    mapper_set_palette(mapper, colors);
+
+    frame = av_frame_alloc();
+    if (!frame) {
+        return AVERROR(ENOMEM);
+    }
+    frame->format = AV_PIX_FMT_PAL8;
+    frame->width = rgb->width;
+    frame->height = rgb->height;
+    ret = av_frame_get_buffer(frame, 0);
+    if (ret >= 0) {
+        ret = av_frame_copy_props(frame, rgb);
+    }
+    if (ret < 0) {
+        av_frame_free(&frame);
+        return ret;
+    }
+    memcpy(frame->data[1], colors, 256 * sizeof(uint32_t));
+    parallel = (mapper->dither == DITHER_SIERRA || mapper->dither == DITHER_FLOYD_STEINBERG) && mapper->diffuser;
+    ret = parallel ? diffuse_frame(mapper, rgb, frame) : AVERROR(EAGAIN);
+    if (ret == AVERROR(EAGAIN)) {
+        // 不需要并行处理，或无法创建线程时逐行串行处理
+        ret = 0;
+        for (int y = 0; y < rgb->height && ret >= 0; y++) {
+            ret = dither_row(mapper, (const uint32_t*)(rgb->data[0] + y * rgb->linesize[0]), \
+                frame->data[0] + y * frame->linesize[0], rgb->width, y);
+        }
+    }
+    if (ret < 0) {
+        av_frame_free(&frame);
+        return ret;
+    }
+    *out = frame;
+
+    return 0;
+}
+
+
+/**
+* 量化器直方图中的一格，每通道取高5位，记录落入该格的像素数与各通道之和。
+*/
+typedef struct QuantBin {
+    uint32_t count;
+    uint32_t sum[3];
+}QuantBin;
+
+
+/**
+* 中位切分的颜色项，即直方图中一个非空格子的平均颜色。
+*/
+typedef struct QuantEntry {
+    uint8_t c[3];    // R、G、B
+    uint32_t count;
+}QuantEntry;
+
+
+/**
+* 中位切分的一个颜色盒，包含entries中[start, end)范围内的颜色项。
+*/
+typedef struct QuantBox {
+    int start;
+    int end;
+    int axis;        // 方差最大的通道
+    double score;    // 该通道上的加权方差之和，越大越优先切分
+}QuantBox;
+
+
+/**
+* 程序内置的调色板量化器，代替palettegen逐帧生成调色板：每隔step个像素（行与列都是）取样统计32x32x32格的直方图，
+* 再对非空格子做中位切分。step越大统计越快，调色板越粗糙。
+*/
+typedef struct Quantizer {
+    QuantBin* bins;
+    int* used;             // 非空格子的序号，用于只清空用过的格子
+    int used_n;
+    QuantEntry* entries;
+    int entry_n;
+    int step;
+    int max_colors;
+    float linear[256];     // sRGB到线性值的转换表，用于计算ΔE
+    float (*cell_lab)[3];  // 颜色映射器查找表各格子中心颜色的CIELAB值，首次用到时才计算
+    uint8_t* cell_done;
+}Quantizer;
+
+
+#define QUANT_BIN(p) ((((p) >> 9) & 0x7C00) | (((p) >> 6) & 0x3E0) | (((p) >> 3) & 0x1F))
+
+
+void quantizer_free(Quantizer** quant)
+{
+    if (*quant) {
+        av_freep(&(*quant)->bins);
+        av_freep(&(*quant)->used);
+        av_freep(&(*quant)->entries);
+        av_freep(&(*quant)->cell_lab);
+        av_freep(&(*quant)->cell_done);
+        av_freep(quant);
+    }
+}
+
+
+/**
+* 分配一个新的量化器，使用结束后需要调用quantizer_free释放。max_colors不含保留的透明色。
+*/
+Quantizer* quantizer_alloc(int step, int max_colors)
+{
+    Quantizer* quant;
+    double v;
+
+    quant = (Quantizer*)av_mallocz(sizeof(Quantizer));
+    if (!quant) {
+        return NULL;
+    }
+    quant->bins = (QuantBin*)av_calloc(32768, sizeof(QuantBin));
+    quant->used = (int*)av_malloc_array(32768, sizeof(int));
+    quant->entries = (QuantEntry*)av_malloc_array(32768, sizeof(QuantEntry));
+    quant->cell_lab = av_malloc_array(262144, sizeof(*quant->cell_lab));
+    quant->cell_done = (uint8_t*)av_mallocz(262144);
+    if (!quant->bins || !quant->used || !quant->entries || !quant->cell_lab || !quant->cell_done) {
+        quantizer_free(&quant);
+        return NULL;
+    }
+    quant->step = FFMAX(step, 1);
+    quant->max_colors = av_clip(max_colors, 1, 255);
+    for (int i = 0; i < 256; i++) {
+        v = i / 255.0;
+        quant->linear[i] = (float)((v <= 0.04045) ? v / 12.92 : pow((v + 0.055) / 1.055, 2.4));
+    }
+
+    return quant;
+}
+
+
+int compare_entry_r(const void* a, const void* b)
+{
+    return ((const QuantEntry*)a)->c[0] - ((const QuantEntry*)b)->c[0];
+}
+
+
+int compare_entry_g(const void* a, const void* b)
+{
+    return ((const QuantEntry*)a)->c[1] - ((const QuantEntry*)b)->c[1];
+}
+
+
+int compare_entry_b(const void* a, const void* b)
+{
+    return ((const QuantEntry*)a)->c[2] - ((const QuantEntry*)b)->c[2];
+}
+
+
+/**
+* 计算颜色盒各通道的加权方差，选出方差最大的通道作为切分方向。
+*/
+void measure_box(const Quantizer* quant, QuantBox* box)
+{
+    double n = 0, sum[3] = { 0 }, sq[3] = { 0 }, var;
+    const QuantEntry* e;
+
+    for (int i = box->start; i < box->end; i++) {
+        e = &quant->entries[i];
+        n += e->count;
+        for (int k = 0; k < 3; k++) {
+            sum[k] += (double)e->count * e->c[k];
+            sq[k] += (double)e->count * e->c[k] * e->c[k];
+        }
+    }
+    box->axis = 0;
+    box->score = 0;
+    if (box->end - box->start < 2) {
+        return;    // 只有一个颜色的盒无法再切分
+    }
+    for (int k = 0; k < 3; k++) {
+        var = sq[k] - sum[k] * sum[k] / n;
+        if (var > box->score) {
+            box->score = var;
+            box->axis = k;
+        }
+    }
+}
+
+
+/**
+* 统计RGB32图像的取样直方图并做中位切分，将生成的调色板写入colors：前若干项为各颜色盒的加权平均色，
+* 其余为透明色（不参与颜色映射）。
+*/
+int quantize_frame(Quantizer* quant, const AVFrame* rgb, uint32_t* colors)
+{
+    int (*compare[3])(const void*, const void*) = { compare_entry_r, compare_entry_g, compare_entry_b };
+    QuantBox boxes[256];
+    int box_n = 1, best, mid;
+    uint32_t p;
+    uint64_t half, acc;
+    double sum[3], n;
+    const uint32_t* row;
+    QuantBin* bin;
+
+    // 取样统计直方图
+    for (int i = 0; i < quant->used_n; i++) {
+        memset(&quant->bins[quant->used[i]], 0, sizeof(QuantBin));
+    }
+    quant->used_n = 0;
+    for (int y = 0; y < rgb->height; y += quant->step) {
+        row = (const uint32_t*)(rgb->data[0] + y * rgb->linesize[0]);
+        for (int x = 0; x < rgb->width; x += quant->step) {
+            p = row[x];
+            bin = &quant->bins[QUANT_BIN(p)];
+            if (!bin->count++) {
+                quant->used[quant->used_n++] = QUANT_BIN(p);
+            }
+            bin->sum[0] += p >> 16 & 0xFF;
+            bin->sum[1] += p >> 8 & 0xFF;
+            bin->sum[2] += p & 0xFF;
+        }
+    }
+    if (!quant->used_n) {
+        return AVERROR(EINVAL);
+    }
+    quant->entry_n = quant->used_n;
+    for (int i = 0; i < quant->used_n; i++) {
+        bin = &quant->bins[quant->used[i]];
+        for (int k = 0; k < 3; k++) {
+            quant->entries[i].c[k] = (uint8_t)((bin->sum[k] + bin->count / 2) / bin->count);
+        }
+        quant->entries[i].count = bin->count;
+    }
+
+    // 中位切分：每次切分加权方差最大的盒，切分点为该通道上的加权中位数
+    boxes[0].start = 0;
+    boxes[0].end = quant->entry_n;
+    measure_box(quant, &boxes[0]);
+    while (box_n < quant->max_colors) {
+        best = 0;
+        for (int i = 1; i < box_n; i++) {
+            if (boxes[i].score > boxes[best].score)
+                best = i;
+        }
+        if (boxes[best].score <= 0) {
+            break;
+        }
+        qsort(quant->entries + boxes[best].start, boxes[best].end - boxes[best].start, sizeof(QuantEntry), \
+            compare[boxes[best].axis]);
+        half = 0;
+        for (int i = boxes[best].start; i < boxes[best].end; i++) {
+            half += quant->entries[i].count;
+        }
+        half /= 2;
+        acc = 0;
+        mid = boxes[best].start;
+        while (mid < boxes[best].end - 1 && acc + quant->entries[mid].count <= half) {
+            acc += quant->entries[mid++].count;
+        }
+        mid = FFMAX(mid, boxes[best].start + 1);
+        boxes[box_n].start = mid;
+        boxes[box_n].end = boxes[best].end;
+        boxes[best].end = mid;
+        measure_box(quant, &boxes[best]);
+        measure_box(quant, &boxes[box_n]);
+        box_n++;
+    }
+
+    memset(colors, 0, 256 * sizeof(uint32_t));
+    for (int i = 0; i < box_n; i++) {
+        n = sum[0] = sum[1] = sum[2] = 0;
+        for (int j = boxes[i].start; j < boxes[i].end; j++) {
+            n += quant->entries[j].count;
+            for (int k = 0; k < 3; k++)
+                sum[k] += (double)quant->entries[j].count * quant->entries[j].c[k];
+        }
+        colors[i] = 0xFF000000 | (uint32_t)lrint(sum[0] / n) << 16 | (uint32_t)lrint(sum[1] / n) << 8 | \
+            (uint32_t)lrint(sum[2] / n);
+    }
+
+    return box_n;
+}
+
+
+/**
+* 将sRGB颜色转换为CIELAB（D65白点）。
+*/
+void color_to_lab(const Quantizer* quant, uint32_t color, double* lab)
+{
+    double r = quant->linear[color >> 16 & 0xFF], g = quant->linear[color >> 8 & 0xFF], b = quant->linear[color & 0xFF];
+    double xyz[3], f[3];
+
+    xyz[0] = (0.4124 * r + 0.3576 * g + 0.1805 * b) / 0.95047;
+    xyz[1] = 0.2126 * r + 0.7152 * g + 0.0722 * b;
+    xyz[2] = (0.0193 * r + 0.1192 * g + 0.9505 * b) / 1.08883;
+    for (int k = 0; k < 3; k++) {
+        f[k] = (xyz[k] > 0.008856) ? cbrt(xyz[k]) : 7.787 * xyz[k] + 16.0 / 116;
+    }
+    lab[0] = 116 * f[1] - 16;
+    lab[1] = 500 * (f[0] - f[1]);
+    lab[2] = 200 * (f[1] - f[2]);
+}
+
+
+/**
+* 计算一帧的量化误差：源图像rgb中每个像素与映射结果pal8中对应调色板颜色之间的ΔE（CIE76）的平均值，包含抖动的影响。
+* 每隔QUANT_ERROR_STEP个像素（行与列都是）取样，取样位置与Sample Step无关，不同设置的结果可以直接比较。
+* 源颜色按颜色映射器查找表的格子（每通道高6位）取中心颜色转换，转换结果在各帧之间缓存。
+*/
+double quant_error(Quantizer* quant, const AVFrame* rgb, const AVFrame* pal8)
+{
+    const uint32_t* palette = (const uint32_t*)pal8->data[1];
+    const uint32_t* src;
+    const uint8_t* dst;
+    double pal_lab[256][3], lab[3], total = 0, d[3];
+    float* cell_lab;
+    int cell, n = 0;
+
+    for (int i = 0; i < 256; i++) {
+        color_to_lab(quant, palette[i], pal_lab[i]);
+    }
+    for (int y = QUANT_ERROR_STEP / 2; y < rgb->height; y += QUANT_ERROR_STEP) {
+        src = (const uint32_t*)(rgb->data[0] + y * rgb->linesize[0]);
+        dst = pal8->data[0] + y * pal8->linesize[0];
+        for (int x = QUANT_ERROR_STEP / 2; x < rgb->width; x += QUANT_ERROR_STEP) {
+            cell = LUT_CELL(src[x]);
+            cell_lab = quant->cell_lab[cell];
+            if (!quant->cell_done[cell]) {
+                color_to_lab(quant, (uint32_t)(cell >> 12) << 18 | (uint32_t)(cell >> 6 & 0x3F) << 10 | \
+                    (uint32_t)(cell & 0x3F) << 2 | 0x020202, lab);
+                for (int k = 0; k < 3; k++)
+                    cell_lab[k] = (float)lab[k];
+                quant->cell_done[cell] = 1;
+            }
+            for (int k = 0; k < 3; k++)
+                d[k] = cell_lab[k] - pal_lab[dst[x]][k];
+            total += sqrt(d[0] * d[0] + d[1] * d[1] + d[2] * d[2]);
+            n++;
+        }
+    }
+
+    return n > 0 ? total / n : 0;
+}
+
+
+/**
+* 直接转换路径：不经过过滤图，逐行完成缩小（按面积平均）、YUV到RGB的转换与调色板映射，直接由解码出的YUV420P帧
+* 生成PAL8帧。每次只处理一行，中间结果都是行缓存，不再为缩放、split与RGB转换各分配一整帧。只支持缩小。
+*/
+typedef struct DirectScaler {
+    int src_w, src_h;
+    int dst_w, dst_h;
+    enum AVPixelFormat format;
+    enum AVColorSpace colorspace;
+    enum AVColorRange range;
+    int* luma_x;      // 每个输出像素在亮度平面上对应的列范围，起点与终点依次存放
+    int* chroma_x;    // 色度平面上的列范围
+    uint32_t* acc;    // Y、U、V三个平面的累加行
+    uint16_t* colsum; // 各列在[y0, y1)行内之和，供向量化的平均使用
+    uint8_t* yuv;     // 平均后的Y、U、V行，每行末尾留有对齐用的空间
+    uint32_t* rgb;
+    int coef[5];      // 14位定点的转换系数：Y、V->R、U->G、V->G、U->B
+    int y_offset;
+    void (*yuv_to_rgb)(const struct DirectScaler* scaler, const uint8_t* y, const uint8_t* u, const uint8_t* v, \
+        uint32_t* rgb, int width);
+    void (*average_rows)(const struct DirectScaler* scaler, const uint8_t* plane, int linesize, int y0, int y1, \
+        const int* ranges, uint32_t* acc, uint8_t* dst, int width);
+}DirectScaler;
+
+
+void yuv_to_rgb_c(const DirectScaler* scaler, const uint8_t* y, const uint8_t* u, const uint8_t* v, \
+    uint32_t* rgb, int width)
+{
+    const int* c = scaler->coef;
+    int l, cb, cr;
+
+    for (int x = 0; x < width; x++) {
+        l = (y[x] - scaler->y_offset) * c[0] + 8192;
+        cb = u[x] - 128;
+        cr = v[x] - 128;
+        rgb[x] = 0xFF000000 | (uint32_t)clip_pixel((l + c[1] * cr) >> 14) << 16 | \
+            (uint32_t)clip_pixel((l + c[2] * cb + c[3] * cr) >> 14) << 8 | clip_pixel((l + c[4] * cb) >> 14);
+    }
+}
+
+
+__attribute__((target("avx2")))
+void yuv_to_rgb_avx2(const DirectScaler* scaler, const uint8_t* y, const uint8_t* u, const uint8_t* v, \
+    uint32_t* rgb, int width)
+{
+    const __m256i cy = _mm256_set1_epi32(scaler->coef[0]), cvr = _mm256_set1_epi32(scaler->coef[1]), \
+        cug = _mm256_set1_epi32(scaler->coef[2]), cvg = _mm256_set1_epi32(scaler->coef[3]), \
+        cub = _mm256_set1_epi32(scaler->coef[4]), offset = _mm256_set1_epi32(scaler->y_offset), \
+        half = _mm256_set1_epi32(128), round = _mm256_set1_epi32(8192), zero = _mm256_setzero_si256(), \
+        max = _mm256_set1_epi32(255), alpha = _mm256_set1_epi32(0xFF000000);
+    __m256i l, cb, cr, r, g, b;
+    int x = 0;
+
+    for (; x + 8 <= width; x += 8) {
+        l = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)(y + x)));
+        cb = _mm256_sub_epi32(_mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)(u + x))), half);
+        cr = _mm256_sub_epi32(_mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)(v + x))), half);
+        l = _mm256_add_epi32(_mm256_mullo_epi32(_mm256_sub_epi32(l, offset), cy), round);
+        r = _mm256_srai_epi32(_mm256_add_epi32(l, _mm256_mullo_epi32(cr, cvr)), 14);
+        g = _mm256_srai_epi32(_mm256_add_epi32(_mm256_add_epi32(l, _mm256_mullo_epi32(cb, cug)), \
+            _mm256_mullo_epi32(cr, cvg)), 14);
+        b = _mm256_srai_epi32(_mm256_add_epi32(l, _mm256_mullo_epi32(cb, cub)), 14);
+        r = _mm256_min_epi32(_mm256_max_epi32(r, zero), max);
+        g = _mm256_min_epi32(_mm256_max_epi32(g, zero), max);
+        b = _mm256_min_epi32(_mm256_max_epi32(b, zero), max);
+        r = _mm256_or_si256(_mm256_or_si256(alpha, _mm256_slli_epi32(r, 16)), _mm256_or_si256(_mm256_slli_epi32(g, 8), b));
+        _mm256_storeu_si256((__m256i*)(rgb + x), r);
+    }
+    yuv_to_rgb_c(scaler, y + x, u + x, v + x, rgb + x, width - x);
+}
+
+
+/**
+* 对[y0, y1)行、由ranges给出各输出像素列范围的区域求平均，结果写入dst。
+*/
+void average_rows_c(const DirectScaler* scaler, const uint8_t* plane, int linesize, int y0, int y1, \
+    const int* ranges, uint32_t* acc, uint8_t* dst, int width)
+{
+    const uint8_t* row;
+    int area;
+
+    memset(acc, 0, width * sizeof(uint32_t));
+    for (int y = y0; y < y1; y++) {
+        row = plane + y * linesize;
+        for (int x = 0; x < width; x++) {
+            for (int k = ranges[2 * x]; k < ranges[2 * x + 1]; k++) {
+                acc[x] += row[k];
+            }
+        }
+    }
+    for (int x = 0; x < width; x++) {
+        area = (ranges[2 * x + 1] - ranges[2 * x]) * (y1 - y0);
+        dst[x] = (uint8_t)((acc[x] + area / 2) / area);
+    }
+}
+
+
+/**
+* average_rows的AVX2实现，结果与C实现相同。先把各行按列纵向累加为16位的列和，再横向求和：
+* 列数恰为输出宽度的2倍或4倍时（最常见的缩小1/2与1/4）用成对相加完成，其余比例逐个输出像素累加列和。
+* 列和须小于32768，超过128行时交给C实现。
+*/
+__attribute__((target("avx2")))
+void average_rows_avx2(const DirectScaler* scaler, const uint8_t* plane, int linesize, int y0, int y1, \
+    const int* ranges, uint32_t* acc, uint8_t* dst, int width)
+{
+    const __m256i ones = _mm256_set1_epi16(1);
+    uint16_t* sum = scaler->colsum;
+    int src_w = ranges[2 * width - 1], ratio = ranges[1] - ranges[0], x = 0, area;
+    __m256i s, a, b;
+
+    if (y1 - y0 > 128) {
+        average_rows_c(scaler, plane, linesize, y0, y1, ranges, acc, dst, width);
+        return;
+    }
+    // 纵向累加，每次16列
+    for (; x + 16 <= src_w; x += 16) {
+        s = _mm256_setzero_si256();
+        for (int y = y0; y < y1; y++) {
+            s = _mm256_add_epi16(s, _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)(plane + y * linesize + x))));
+        }
+        _mm256_storeu_si256((__m256i*)(sum + x), s);
+    }
+    for (; x < src_w; x++) {
+        sum[x] = 0;
+        for (int y = y0; y < y1; y++) {
+            sum[x] += plane[y * linesize + x];
+        }
+    }
+
+    // 横向求和
+    x = 0;
+    if (ratio == 2 && src_w == 2 * width) {
+        for (; x + 8 <= width; x += 8) {
+            s = _mm256_loadu_si256((const __m256i*)(sum + 2 * x));
+            _mm256_storeu_si256((__m256i*)(acc + x), _mm256_madd_epi16(s, ones));
+        }
+    }
+    else if (ratio == 4 && src_w == 4 * width) {
+        for (; x + 8 <= width; x += 8) {
+            a = _mm256_madd_epi16(_mm256_loadu_si256((const __m256i*)(sum + 4 * x)), ones);
+            b = _mm256_madd_epi16(_mm256_loadu_si256((const __m256i*)(sum + 4 * x + 16)), ones);
+            _mm256_storeu_si256((__m256i*)(acc + x), _mm256_permute4x64_epi64(_mm256_hadd_epi32(a, b), 0xD8));
+        }
+    }
+    for (; x < width; x++) {
+        acc[x] = 0;
+        for (int k = ranges[2 * x]; k < ranges[2 * x + 1]; k++) {
+            acc[x] += sum[k];
+        }
+    }
+    for (x = 0; x < width; x++) {
+        area = (ranges[2 * x + 1] - ranges[2 * x]) * (y1 - y0);
+        dst[x] = (uint8_t)((acc[x] + area / 2) / area);
+    }
+}
+
+
+void scaler_free(DirectScaler** scaler)
+{
+    if (*scaler) {
+        av_freep(&(*scaler)->luma_x);
+        av_freep(&(*scaler)->chroma_x);
+        av_freep(&(*scaler)->acc);
+        av_freep(&(*scaler)->colsum);
+        av_freep(&(*scaler)->yuv);
+        av_freep(&(*scaler)->rgb);
+        av_freep(scaler);
+    }
+}
+
+
+/**
+* 直接转换路径是否支持该帧：YUV420P输入，且输出尺寸不大于输入。
+*/
+int direct_supported(const AVFrame* frame, int dst_w, int dst_h)
+{
+    return (frame->format == AV_PIX_FMT_YUV420P || frame->format == AV_PIX_FMT_YUVJ420P) && \
+        dst_w <= frame->width && dst_h <= frame->height && dst_w > 0 && dst_h > 0;
+}
+
+
+/**
+* 按输入帧的尺寸与色彩参数分配直接转换所需的行缓存与系数。使用结束后需要调用scaler_free释放。
+*/
+DirectScaler* scaler_alloc(const AVFrame* frame, int dst_w, int dst_h)
+{
+    DirectScaler* scaler;
+    int chroma_w = (frame->width + 1) / 2, stride = FFALIGN(dst_w, 32);
+    int full = frame->format == AV_PIX_FMT_YUVJ420P || frame->color_range == AVCOL_RANGE_JPEG;
+    double kr = 0.299, kb = 0.114, ky, kc;
+
+    scaler = (DirectScaler*)av_mallocz(sizeof(DirectScaler));
+    if (!scaler) {
+        return NULL;
+    }
+    scaler->src_w = frame->width;
+    scaler->src_h = frame->height;
+    scaler->dst_w = dst_w;
+    scaler->dst_h = dst_h;
+    scaler->format = frame->format;
+    scaler->colorspace = frame->colorspace;
+    scaler->range = frame->color_range;
+    scaler->luma_x = (int*)av_malloc_array(2 * dst_w, sizeof(int));
+    scaler->chroma_x = (int*)av_malloc_array(2 * dst_w, sizeof(int));
+    scaler->acc = (uint32_t*)av_malloc_array(3 * dst_w, sizeof(uint32_t));
+    scaler->colsum = (uint16_t*)av_malloc_array(FFALIGN(frame->width, 32), sizeof(uint16_t));
+    scaler->yuv = (uint8_t*)av_malloc(3 * stride);
+    scaler->rgb = (uint32_t*)av_malloc_array(dst_w, sizeof(uint32_t));
+    if (!scaler->luma_x || !scaler->chroma_x || !scaler->acc || !scaler->colsum || !scaler->yuv || !scaler->rgb) {
+        scaler_free(&scaler);
+        return NULL;
+    }
+
+    // 每个输出像素覆盖的源像素范围。色度平面在输出较宽时范围可能为空，此时至少取一列
+    for (int x = 0; x < dst_w; x++) {
+        scaler->luma_x[2 * x] = (int)((int64_t)x * frame->width / dst_w);
+        scaler->luma_x[2 * x + 1] = (int)((int64_t)(x + 1) * frame->width / dst_w);
+
+        scaler->chroma_x[2 * x] = (int)((int64_t)x * chroma_w / dst_w);
+        scaler->chroma_x[2 * x + 1] = FFMAX((int)((int64_t)(x + 1) * chroma_w / dst_w), scaler->chroma_x[2 * x] + 1);
+    }
+
+    // 与swscale一致，除BT.709外都按BT.601处理
+    if (frame->colorspace == AVCOL_SPC_BT709) {
+        kr = 0.2126;
+        kb = 0.0722;
+    }
+    ky = full ? 1.0 : 255.0 / 219;
+    kc = full ? 1.0 : 255.0 / 224;
+    scaler->y_offset = full ? 0 : 16;
+    scaler->coef[0] = (int)lrint(ky * 16384);
+    scaler->coef[1] = (int)lrint(2 * (1 - kr) * kc * 16384);
+    scaler->coef[2] = (int)lrint(-2 * (1 - kb) * kb / (1 - kr - kb) * kc * 16384);
+    scaler->coef[3] = (int)lrint(-2 * (1 - kr) * kr / (1 - kr - kb) * kc * 16384);
+    scaler->coef[4] = (int)lrint(2 * (1 - kb) * kc * 16384);
+    scaler->yuv_to_rgb = (av_get_cpu_flags() & AV_CPU_FLAG_AVX2) ? yuv_to_rgb_avx2 : yuv_to_rgb_c;
+    scaler->average_rows = (av_get_cpu_flags() & AV_CPU_FLAG_AVX2) ? average_rows_avx2 : average_rows_c;
+
+    return scaler;
+}
+
+
+/**
+* 由直接转换路径将YUV420P帧src转换为按palette映射的PAL8帧，写入新分配的out中。
+*/
+int direct_frame(DirectScaler* scaler, ColorMapper* mapper, const AVFrame* src, const uint32_t* colors, AVFrame** out)
+{
+    int ret, y0, y1, c0, c1, chroma_h = (src->height + 1) / 2, stride = FFALIGN(scaler->dst_w, 32);
+    uint8_t* y_row = scaler->yuv, * u_row = scaler->yuv + stride, * v_row = scaler->yuv + 2 * stride;
+    AVFrame* frame;
+
+    mapper_set_palette(mapper, colors);
+    frame = av_frame_alloc();
+    if (!frame) {
+        return AVERROR(ENOMEM);
+    }
+    frame->format = AV_PIX_FMT_PAL8;
+    frame->width = scaler->dst_w;
+    frame->height = scaler->dst_h;
+    ret = av_frame_get_buffer(frame, 0);
+    if (ret >= 0) {
+        ret = av_frame_copy_props(frame, src);
+    }
+    if (ret < 0) {
+        av_frame_free(&frame);
+        return ret;
+    }
+    memcpy(frame->data[1], colors, 256 * sizeof(uint32_t));
+
+    for (int y = 0; y < scaler->dst_h; y++) {
+        y0 = (int)((int64_t)y * src->height / scaler->dst_h);
+        y1 = (int)((int64_t)(y + 1) * src->height / scaler->dst_h);
+        c0 = (int)((int64_t)y * chroma_h / scaler->dst_h);
+        c1 = FFMAX((int)((int64_t)(y + 1) * chroma_h / scaler->dst_h), c0 + 1);
+        scaler->average_rows(scaler, src->data[0], src->linesize[0], y0, y1, scaler->luma_x, scaler->acc, \
+            y_row, scaler->dst_w);
+        scaler->average_rows(scaler, src->data[1], src->linesize[1], c0, c1, scaler->chroma_x, \
+            scaler->acc + scaler->dst_w, u_row, scaler->dst_w);
+        scaler->average_rows(scaler, src->data[2], src->linesize[2], c0, c1, scaler->chroma_x, \
+            scaler->acc + 2 * scaler->dst_w, v_row, scaler->dst_w);
+        scaler->yuv_to_rgb(scaler, y_row, u_row, v_row, scaler->rgb, scaler->dst_w);
+        ret = dither_row(mapper, scaler->rgb, frame->data[0] + y * frame->linesize[0], scaler->dst_w, y);
+        if (ret < 0) {
+            av_frame_free(&frame);
+            return ret;
+        }
+    }
+    *out = frame;
+
+    return 0;
+}
+
+
+/**
+* 帧间差分器。各线程的编码器相互独立时，编码器自身的帧间差分（gifflags）无从参考上一帧，改由差分器找出
+* 与上一输出帧显示颜色不同的最小矩形，只编码该区域，并将其位置写入图像描述符；区域之外的像素保持上一帧的内容。
+*/
+typedef struct FrameDiffer {
+    AVFrame* last;             // 上一输出帧，仅在由本线程按顺序处理所有帧（history为空）时使用
+    FrameHistory* history;     // 各滤镜线程共享的输出帧缓冲区
+    AVCodecContext* codec;     // 按变化区域的尺寸打开的编码器，尺寸不变时复用
+    int (*diff_span)(const uint8_t* prev, const uint8_t* cur, const uint32_t* prev_pal, const uint32_t* cur_pal, \
+        int width, int* first, int* last);
+    int64_t rect_area;         // 实际编码的像素总数
+    int64_t frame_area;        // 各帧完整的像素总数
+    int64_t hint_area;         // 由运动矢量直接确定为有变化、未经比较的像素总数
+}FrameDiffer;
+
+
+static inline int same_color(const uint8_t* prev, const uint8_t* cur, const uint32_t* prev_pal, const uint32_t* cur_pal, int x)
+{
+    return prev_pal ? prev_pal[prev[x]] == cur_pal[cur[x]] : prev[x] == cur[x];
+}
+
+
+/**
+* 比较两行PAL8像素，将显示颜色不同的第一个与最后一个位置存入first与last，没有差异时返回0。
+* prev_pal为空表示两帧使用同一调色板，此时直接比较颜色序号，否则比较序号对应的颜色。
+*/
+int diff_span_c(const uint8_t* prev, const uint8_t* cur, const uint32_t* prev_pal, const uint32_t* cur_pal, \
+    int width, int* first, int* last)
+{
+    int x0 = 0, x1 = width - 1;
+
+    while (x0 < width && same_color(prev, cur, prev_pal, cur_pal, x0)) {
+        x0++;
+    }
+    if (x0 == width) {
+        return 0;
+    }
+    while (same_color(prev, cur, prev_pal, cur_pal, x1)) {
+        x1--;
+    }
+    *first = x0;
+    *last = x1;
+
+    return 1;
+}
+
+
+/**
+* 返回从x开始的一组像素中颜色不同者的位掩码。共用调色板时一次比较32个序号，否则一次比较8个颜色。
+*/
+__attribute__((target("avx2")))
+static inline uint32_t diff_mask_avx2(const uint8_t* prev, const uint8_t* cur, const uint32_t* prev_pal, \
+    const uint32_t* cur_pal, int x)
+{
+    __m256i a, b;
+
+    if (!prev_pal) {
+        a = _mm256_loadu_si256((const __m256i*)(prev + x));
+        b = _mm256_loadu_si256((const __m256i*)(cur + x));
+        return ~(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(a, b));
+    }
+    a = _mm256_i32gather_epi32((const int*)prev_pal, _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)(prev + x))), 4);
+    b = _mm256_i32gather_epi32((const int*)cur_pal, _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)(cur + x))), 4);
+    return ~(uint32_t)_mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(a, b))) & 0xFF;
+}
+
+
+__attribute__((target("avx2")))
+int diff_span_avx2(const uint8_t* prev, const uint8_t* cur, const uint32_t* prev_pal, const uint32_t* cur_pal, \
+    int width, int* first, int* last)
+{
+    int step = prev_pal ? 8 : 32, x0 = 0, x1;
+    uint32_t mask = 0;
+
+    // 从左向右逐组比较，不足一组的部分逐个比较
+    for (; x0 + step <= width; x0 += step) {
+        mask = diff_mask_avx2(prev, cur, prev_pal, cur_pal, x0);
+        if (mask)
+            break;
+    }
+    if (mask) {
+        x0 += __builtin_ctz(mask);
+    }
+    else {
+        while (x0 < width && same_color(prev, cur, prev_pal, cur_pal, x0)) {
+            x0++;
+        }
+        if (x0 == width) {
+            return 0;
+        }
+    }
+    *first = x0;
+
+    // 从右向左逐组比较，至多回到x0所在处
+    for (x1 = width; x1 - step >= x0; x1 -= step) {
+        mask = diff_mask_avx2(prev, cur, prev_pal, cur_pal, x1 - step);
+        if (mask) {
+            *last = x1 - step + 31 - __builtin_clz(mask);
+            return 1;
+        }
+    }
+    x1--;
+    while (same_color(prev, cur, prev_pal, cur_pal, x1)) {
+        x1--;
+    }
+    *last = x1;
+
+    return 1;
+}
+
+
+/**
+* 分配一个新的帧间差分器。history为空时，差分器假定所有帧都由同一线程按顺序送入。使用结束后需要调用differ_free释放。
+*/
+FrameDiffer* differ_alloc(FrameHistory* history)
+{
+    FrameDiffer* differ;
+
+    differ = (FrameDiffer*)av_mallocz(sizeof(FrameDiffer));
+    if (differ) {
+        differ->history = history;
+        differ->diff_span = (av_get_cpu_flags() & AV_CPU_FLAG_AVX2) ? diff_span_avx2 : diff_span_c;
+    }
+
+    return differ;
+}
+
+
+void differ_free(FrameDiffer** differ)
+{
+    if (*differ) {
+        av_frame_free(&(*differ)->last);
+        avcodec_free_context(&(*differ)->codec);
+        av_freep(differ);
+    }
+}
+
+
+/**
+* 找出cur与prev（尺寸相同的PAL8帧）显示颜色不同的像素所在的最小矩形，按x、y、宽、高存入rect。两帧完全相同时返回0。
+* hint不为空时，其中的区域直接视为有变化：这些行只需比较区域左右两侧的像素，结果是包含hint的矩形。
+*/
+int changed_rect(const FrameDiffer* differ, const AVFrame* prev, const AVFrame* cur, const int* hint, int* rect)
+{
+    const uint32_t* prev_pal, * cur_pal = (const uint32_t*)cur->data[1];
+    const uint8_t* p, * c;
+    int x0 = cur->width, x1 = -1, y0 = -1, y1 = -1, first, last;
+
+    if (hint) {
+        x0 = hint[0];
+        x1 = hint[0] + hint[2] - 1;
+        y0 = hint[1];
+        y1 = hint[1] + hint[3] - 1;
+    }
+    // 两帧调色板相同时只需比较颜色序号
+    prev_pal = memcmp(prev->data[1], cur->data[1], 256 * sizeof(uint32_t)) ? (const uint32_t*)prev->data[1] : NULL;
+    for (int y = 0; y < cur->height; y++) {
+        p = prev->data[0] + y * prev->linesize[0];
+        c = cur->data[0] + y * cur->linesize[0];
+        if (hint && y >= hint[1] && y < hint[1] + hint[3]) {
+            if (x0 > 0 && differ->diff_span(p, c, prev_pal, cur_pal, x0, &first, &last))
+                x0 = first;
+            if (x1 < cur->width - 1 && differ->diff_span(p + x1 + 1, c + x1 + 1, prev_pal, cur_pal, \
+                cur->width - x1 - 1, &first, &last))
+                x1 += last + 1;
+            continue;
+        }
+        if (differ->diff_span(p, c, prev_pal, cur_pal, cur->width, &first, &last)) {
+            y0 = (y0 < 0) ? y : FFMIN(y0, y);
+            y1 = FFMAX(y1, y);
+            x0 = FFMIN(x0, first);
+            x1 = FFMAX(x1, last);
+        }
+    }
+    if (y0 < 0) {
+        return 0;
+    }
+    rect[0] = x0;
+    rect[1] = y0;
+    rect[2] = x1 - x0 + 1;
+    rect[3] = y1 - y0 + 1;
+
+    return 1;
+}
+
+
+/**
+* 为宽width、高height的区域打开编码器，gifflags与global_palette两个选项沿用base。已打开同尺寸的编码器时直接复用。
+*/
+int open_rect_encoder(FrameDiffer* differ, const AVCodecContext* base, int width, int height)
+{
+    int ret;
+    int64_t value;
+    AVCodecContext* codec;
+    AVDictionary* opt = NULL;
+
+    if (differ->codec && differ->codec->width == width && differ->codec->height == height) {
+        return 0;
+    }
+    avcodec_free_context(&differ->codec);
+    codec = avcodec_alloc_context3(base->codec);
+    if (!codec) {
+        return AVERROR(ENOMEM);
+    }
+    differ->codec = codec;
+    codec->width = width;
+    codec->height = height;
+    codec->pix_fmt = base->pix_fmt;
+    codec->time_base = base->time_base;
+    if (av_opt_get_int((void*)base, "gifflags", AV_OPT_SEARCH_CHILDREN, &value) >= 0)
+        av_dict_set_int(&opt, "gifflags", value, 0);
+    if (av_opt_get_int((void*)base, "global_palette", AV_OPT_SEARCH_CHILDREN, &value) >= 0)
+        av_dict_set_int(&opt, "global_palette", value, 0);
+    ret = avcodec_open2(codec, base->codec, &opt);
+    av_dict_free(&opt);
+
+    return ret;
+}
+
+
+/**
+* 以序号为seq的上一帧为参考编码frame，结果写入packet：只编码变化区域，没有变化时编码左上角的一个像素；
+* 没有参考帧或整帧都有变化时由codec完整编码。hint为由运动矢量确定的变化区域，可为空。
+* 每个序号都必须调用一次本函数或differ_skip。
+*/
+int encode_changes(FrameDiffer* differ, AVCodecContext* codec, AVFrame* frame, int64_t seq, const int* hint, \
+    AVPacket* packet)
+{
+    int ret, rect[4] = { 0, 0, 1, 1 };
+    AVFrame* ref, * prev = NULL, * sub = NULL;
+
+    // 先存入本帧供下一帧参考，再取得上一帧
+    ref = av_frame_clone(frame);
+    if (differ->history) {
+        history_exchange(differ->history, seq, ref, &prev);
+    }
+    else {
+        prev = differ->last;
+        differ->last = ref;
+    }
+    differ->frame_area += (int64_t)frame->width * frame->height;
+
+    if (!prev || prev->width != frame->width || prev->height != frame->height) {
+        rect[2] = frame->width;
+        rect[3] = frame->height;
+    }
+    else if (changed_rect(differ, prev, frame, hint, rect)) {
+        if (hint)
+            differ->hint_area += (int64_t)hint[2] * hint[3];
+        // 宽高向上对齐，超出帧的部分向左上方扩展
+        rect[2] = FFMIN(FFALIGN(rect[2], RECT_ALIGN), frame->width);
+        rect[3] = FFMIN(FFALIGN(rect[3], RECT_ALIGN), frame->height);
+        rect[0] = FFMIN(rect[0], frame->width - rect[2]);
+        rect[1] = FFMIN(rect[1], frame->height - rect[3]);
+    }
+    av_frame_free(&prev);
+    differ->rect_area += (int64_t)rect[2] * rect[3];
+    if (rect[2] == frame->width && rect[3] == frame->height) {
+        return encode_packet(codec, frame, packet);
+    }
+
+    ret = open_rect_encoder(differ, codec, rect[2], rect[3]);
+    if (ret >= 0) {
+        sub = av_frame_alloc();
+        ret = sub ? av_frame_ref(sub, frame) : AVERROR(ENOMEM);
+    }
+    if (ret >= 0) {
+        sub->data[0] += rect[1] * sub->linesize[0] + rect[0];
+        sub->width = rect[2];
+        sub->height = rect[3];
+        ret = encode_packet(differ->codec, sub, packet);
+    }
+    if (ret >= 0) {
+        ret = set_image_offset(packet, rect[0], rect[1]);
+    }
+    av_frame_free(&sub);
+
+    return ret;
+}
+
+
+/**
+* 序号为seq的帧处理失败时调用，下一帧将不再以任何帧为参考。
+*/
+void differ_skip(FrameDiffer* differ, int64_t seq)
+{
+    AVFrame* prev = NULL;
+
+    if (differ->history) {
+        history_exchange(differ->history, seq, NULL, &prev);
+        av_frame_free(&prev);
+    }
+    else {
+        av_frame_free(&differ->last);
+    }
+}
+
+
+#ifdef BENCHMARK
+/**
+* 逐一比较调色板中所有颜色的参考实现，用于校验颜色映射器的结果。
+*/
+int nearest_color_ref(const ColorMapper* mapper, uint32_t color)
+{
+    int best = 0, best_d = INT_MAX, d;
+
+    for (int i = 0; i < 256; i++) {
+        if (!color_opaque(mapper, i)) {
+            continue;
+        }
+        d = color_distance(color, mapper->palette[i]);
+        if (d < best_d) {
+            best_d = d;
+            best = i;
+        }
+    }
+
+    return best;
+}
+
+
+/**
+* 按paletteuse中dither_value的写法逐项计算的Bayer矩阵，用于校验mapper_set_dither的结果。
+*/
+int bayer_value_ref(int p)
+{
+    const int q = p ^ (p >> 3);
+
+    return (p & 4) >> 2 | (q & 4) >> 1 | (p & 2) << 1 | (q & 2) << 2 | (p & 1) << 4 | (q & 1) << 5;
+}
+
+
+/**
+* 以随机调色板与1920x1080的合成图像测试各指令集实现的速度，并与参考实现逐像素比较。
+*/
+void benchmark_mapper()
+{
+    const int width = 1920, height = 1080, rounds = 10;
+    const char* names[] = { "c", "sse4", "avx2" };
+    const char* dither_names[] = { "none", "bayer", "sierra2_4a", "floyd_steinberg" };
+    void (*rows[])(ColorMapper*, const uint32_t*, uint8_t*, int) = { map_row_c, map_row_sse4, map_row_avx2 };
+    int flags = av_get_cpu_flags(), supported[] = { 1, flags & AV_CPU_FLAG_SSE4, flags & AV_CPU_FLAG_AVX2 };
+    uint32_t palette[256], * image, seed = 12345;
+    uint8_t* ref, * dst;
+    ColorMapper* mapper = NULL;
+    AVFrame* rgb = NULL, * out = NULL;
+    int64_t start_time, elapsed, first;
+    int mismatch;
+
+    image = (uint32_t*)av_malloc(width * height * sizeof(uint32_t));
+    ref = (uint8_t*)av_malloc(width * height);
+    dst = (uint8_t*)av_malloc(width * height);
+    mapper = mapper_alloc();
+    if (!image || !ref || !dst || !mapper) {
+        goto end;
+    }
+    for (int i = 0; i < 256; i++) {
+        seed = seed * 1664525 + 1013904223;
+        palette[i] = 0xFF000000 | (seed >> 8);
+    }
+    palette[255] = 0;    // 与palettegen一致，保留一个透明色
+    for (int y = 0; y < height; y++) {
+        for (int x = 0; x < width; x++) {
+            // 渐变叠加少量噪声，接近真实画面的颜色分布
+            seed = seed * 1664525 + 1013904223;
+            image[y * width + x] = 0xFF000000 | ((x * 255 / width) << 16) | ((y * 255 / height) << 8) | \
+                (((x + y) & 0xFF) ^ (seed >> 28));
+        }
+    }
+    mapper_set_palette(mapper, palette);
+    for (int i = 0; i < width * height; i++) {
+        ref[i] = (uint8_t)nearest_color_ref(mapper, image[i]);
+    }
+
+    printf("Color mapper benchmark (%dx%d, %d frames):\n", width, height, rounds);
+    for (int k = 0; k < 3; k++) {
+        if (!supported[k]) {
+            printf("  %-5s  not supported\n", names[k]);
+            continue;
+        }
+        mapper_free(&mapper);
+        mapper = mapper_alloc();
+        if (!mapper) {
+            goto end;
+        }
+        mapper_set_palette(mapper, palette);
+        // 第一帧包含查找表的计算时间，单独计时
+        start_time = av_gettime_relative();
+        for (int y = 0; y < height; y++) {
+            rows[k](mapper, image + y * width, dst + y * width, width);
+        }
+        first = av_gettime_relative() - start_time;
+        start_time = av_gettime_relative();
+        for (int r = 0; r < rounds; r++) {
+            for (int y = 0; y < height; y++) {
+                rows[k](mapper, image + y * width, dst + y * width, width);
+            }
+        }
+        elapsed = av_gettime_relative() - start_time;
+        printf("  %-5s  first %.2fms  then %.2fms/frame  %s\n", names[k], first / 1e3, elapsed / 1e3 / rounds, \
+            memcmp(ref, dst, width * height) ? "MISMATCH" : "identical");
+    }
+
+    // Bayer矩阵须与paletteuse逐项相同，两条路径的抖动图案才会一致
+    mismatch = 0;
+    for (int scale = 0; scale <= 5; scale++) {
+        mapper_set_dither(mapper, DITHER_BAYER, scale, 1);
+        for (int i = 0; i < 64; i++) {
+            if (mapper->bayer[i] != (bayer_value_ref(i) >> scale) - (1 << (5 - scale)))
+                mismatch++;
+        }
+    }
+    printf("Bayer matrix vs paletteuse: %s\n", mismatch ? "MISMATCH" : "identical");
+
+    // 各抖动方式的速度（使用按CPU选择的实现，先映射一帧以建立查找表）
+    printf("Dither modes:\n");
+    for (int k = DITHER_NONE; k <= DITHER_FLOYD_STEINBERG; k++) {
+        mapper_set_dither(mapper, k, 2, 1);
+        for (int y = 0; y < height; y++) {
+            dither_row(mapper, image + y * width, dst + y * width, width, y);    // 抖动后的颜色会用到新的格子
+        }
+        start_time = av_gettime_relative();
+        for (int r = 0; r < rounds; r++) {
+            for (int y = 0; y < height; y++) {
+                dither_row(mapper, image + y * width, dst + y * width, width, y);
+            }
+        }
+        elapsed = av_gettime_relative() - start_time;
+        printf("  %-15s  %.2fms/frame\n", dither_names[k], elapsed / 1e3 / rounds);
+    }
+
+    // 波前并行的Floyd-Steinberg，与串行结果逐像素比较
+    rgb = av_frame_alloc();
+    if (!rgb) {
+        goto end;
+    }
+    rgb->format = AV_PIX_FMT_RGB32;
+    rgb->width = width;
+    rgb->height = height;
+    rgb->data[0] = (uint8_t*)image;
+    rgb->linesize[0] = width * sizeof(uint32_t);
+    mapper_set_dither(mapper, DITHER_FLOYD_STEINBERG, 2, 1);
+    for (int y = 0; y < height; y++) {
+        dither_row(mapper, image + y * width, ref + y * width, width, y);
+    }
+    for (int threads = 2; threads <= 8; threads *= 2) {
+        mapper_set_dither(mapper, DITHER_FLOYD_STEINBERG, 2, threads);
+        diffuser_start(mapper);
+        start_time = av_gettime_relative();
+        for (int r = 0; r < rounds; r++) {
+            av_frame_free(&out);
+            if (map_frame(mapper, rgb, palette, &out) < 0)
+                goto end;
+        }
+        elapsed = av_gettime_relative() - start_time;
+        for (int y = 0; y < height; y++) {
+            memcpy(dst + y * width, out->data[0] + y * out->linesize[0], width);
+        }
+        printf("  floyd_steinberg x%d  %.2fms/frame  %s\n", threads, elapsed / 1e3 / rounds, \
+            memcmp(ref, dst, width * height) ? "MISMATCH" : "identical");
+    }
+
+end:
+    mapper_free(&mapper);
+    av_frame_free(&rgb);
+    av_frame_free(&out);
+    av_free(image);
+    av_free(ref);
+    av_free(dst);
+}
+#endif
+
+
+/**
+* 预先生成的调色板，从pts开始直到下一场景之前的帧都使用该调色板。
+*/
+typedef struct ScenePalette {
+    int64_t pts;
+    AVFrame* palette;
+}ScenePalette;
+
+
+void scenes_free(ScenePalette** scenes, int count)
+{
+    if (*scenes) {
+        for (int i = 0; i < count; i++) {
+            av_frame_free(&(*scenes)[i].palette);
+        }
+        av_freep(scenes);
+    }
+}
+
+
+/**
+* 返回时间戳pts所在场景的序号，从hint开始向后查找。
+*/
+int find_scene(const ScenePalette* scenes, int count, int64_t pts, int hint)
+{
+    int i = (hint > 0 && hint < count && scenes[hint].pts <= pts) ? hint : 0;
+
+    while (i + 1 < count && pts >= scenes[i + 1].pts) {
+        i++;
+    }
+
+    return i;
+}
+
+
+/**
+* 包含一套独立过滤图的滤镜线程结构体。
+*/
+typedef struct FilterThreadContext {
+    int id;
+    AVFilterGraph* graph;
+    AVFilterContext* buf_filter;
+    AVFilterContext* sink_filter;
+    AVFilterContext* pal_filter;       // 固定调色板的输入端，仅在使用预先生成的调色板时存在
+    AVFilterContext* pal_sink;         // 调色板的输出端，仅在由颜色映射器逐帧映射生成的调色板时存在
+    ColorMapper* mapper;               // 颜色映射器，为空时由paletteuse完成颜色映射
+    Quantizer* quantizer;              // 内置的调色板量化器，为空时由palettegen生成调色板
+    DirectScaler* scaler;              // 直接转换路径的行缓存，在第一次使用时按帧的尺寸分配
+    int direct;                        // 是否对支持的帧使用直接转换路径
+    char** filters;                    // 过滤图的描述，切换场景时用于重建过滤图
+    int filter_n;
+    char* buf_args;
+    char* pal_args;
+    int pal_out;
+    enum AVPixelFormat sink_fmt;
+    const ScenePalette* scenes;        // 各场景的调色板，为空时由过滤图逐帧生成调色板
+    int scene;                         // 当前过滤图所用调色板对应的场景
+    double pts_factor;
+    int64_t pts_start;                 // 输出GIF的起始时间戳（流时间基），对应时间戳0
+    AVCodecContext* codec;             // 该线程独占的编码器
+    FrameDiffer* differ;               // 帧间差分器，仅在各线程的编码器相互独立时使用
+    AVThreadMessageQueue* in_queue;    // 所有滤镜线程共享的待处理帧队列，空闲的线程即可取帧
+    ReorderBuffer* out_buffer;         // 所有滤镜线程共享的结果重排缓冲区
+    int frame_n;          // 已处理的帧数
+    int64_t busy_time;    // 处理帧所用的时间（微秒）
+    double delta_e;       // 各帧量化误差（平均ΔE）之和，仅在使用内置量化器时统计
+}FilterThreadContext;
+
+
+/**
+* 清空FilterThreadContext结构体所关联的内存。
+*/
+void filter_free(FilterThreadContext** ctx)
+{
+    if (*ctx) {
+        (*ctx)->buf_filter = NULL;
+        (*ctx)->sink_filter = NULL;
+        (*ctx)->pal_filter = NULL;
+        (*ctx)->pal_sink = NULL;
+        if ((*ctx)->graph) {
+            avfilter_graph_free(&(*ctx)->graph);
+        }
+        if ((*ctx)->mapper) {
+            mapper_free(&(*ctx)->mapper);
+        }
+        if ((*ctx)->quantizer) {
+            quantizer_free(&(*ctx)->quantizer);
+        }
+        if ((*ctx)->scaler) {
+            scaler_free(&(*ctx)->scaler);
+        }
+        if ((*ctx)->codec) {
+            avcodec_free_context(&(*ctx)->codec);
+        }
+        if ((*ctx)->differ) {
+            differ_free(&(*ctx)->differ);
+        }
+        (*ctx)->in_queue = NULL;
+        (*ctx)->out_buffer = NULL;
+        free(*ctx);
+        *ctx = NULL;
+    }
+}
+
+
+/**
+* 按滤镜线程结构体中保存的描述创建过滤图。
+*/
+int build_graph(FilterThreadContext* filter_ctx)
+{
+    int ret = 0;
+    const AVFilter* buf_filter, * sink_filter;
+    enum AVPixelFormat pixel_fmts[] = {filter_ctx->sink_fmt, AV_PIX_FMT_NONE};
+    enum AVPixelFormat pal_fmts[] = {AV_PIX_FMT_RGB32, AV_PIX_FMT_NONE};
+    AVFilterInOut* inputs = NULL, * outputs = NULL, * pal_outputs = NULL, * pal_inputs = NULL;
+
+    filter_ctx->buf_filter = NULL;
+    filter_ctx->sink_filter = NULL;
+    filter_ctx->pal_filter = NULL;
+    filter_ctx->pal_sink = NULL;
+    filter_ctx->graph = avfilter_graph_alloc();
+    if (!filter_ctx->graph) {
+        ret = AVERROR(ENOMEM);
+        goto end;
+    }
+
+    // 创建源过滤器和接收过滤器
+    buf_filter = avfilter_get_by_name("buffer");
+    ret = avfilter_graph_create_filter(&filter_ctx->buf_filter, buf_filter, "buffer", filter_ctx->buf_args, NULL, filter_ctx->graph);
+    sink_filter = avfilter_get_by_name("buffersink");
+    ret = avfilter_graph_create_filter(&filter_ctx->sink_filter, sink_filter, "buffersink", NULL, NULL, filter_ctx->graph);
+    ret = av_opt_set_int_list(filter_ctx->sink_filter, "pix_fmts", pixel_fmts, AV_PIX_FMT_NONE, AV_OPT_SEARCH_CHILDREN);
+    if (ret >= 0 && filter_ctx->pal_args) {
+        ret = avfilter_graph_create_filter(&filter_ctx->pal_filter, buf_filter, "palette", filter_ctx->pal_args, NULL, filter_ctx->graph);
+    }
+    if (ret >= 0 && filter_ctx->pal_out) {
+        ret = avfilter_graph_create_filter(&filter_ctx->pal_sink, sink_filter, "palettesink", NULL, NULL, filter_ctx->graph);
+        if (ret >= 0) {
+            ret = av_opt_set_int_list(filter_ctx->pal_sink, "pix_fmts", pal_fmts, AV_PIX_FMT_NONE, AV_OPT_SEARCH_CHILDREN);
+        }
+    }
+    if (ret < 0 || !filter_ctx->buf_filter || !filter_ctx->sink_filter || (filter_ctx->pal_args && !filter_ctx->pal_filter) || \
+        (filter_ctx->pal_out && !filter_ctx->pal_sink)) {
+        printf("Fail to initialize filter graph.\n");
+        if (ret >= 0) ret = AVERROR(ENOMEM);
+        goto end;
+    }
+
+    // 创建过滤器链接表
+    outputs = avfilter_inout_alloc();
+    inputs = avfilter_inout_alloc();
+    if (outputs && inputs) {
+        outputs->name = av_strdup("in");
+        outputs->filter_ctx = filter_ctx->buf_filter;
+        outputs->pad_idx = 0;
+        outputs->next = NULL;
+        inputs->name = av_strdup("out");
+        inputs->filter_ctx = filter_ctx->sink_filter;
+        inputs->pad_idx = 0;
+        inputs->next = NULL;
+    }
+    else {
+        printf("Fail to initialize filter graph.\n");
+        ret = AVERROR(ENOMEM);
+        goto end;
+    }
+    if (filter_ctx->pal_filter) {
+        pal_outputs = avfilter_inout_alloc();
+        if (!pal_outputs) {
+            ret = AVERROR(ENOMEM);
+            goto end;
+        }
+        pal_outputs->name = av_strdup("pal");
+        pal_outputs->filter_ctx = filter_ctx->pal_filter;
+        pal_outputs->pad_idx = 0;
+        pal_outputs->next = NULL;
+        outputs->next = pal_outputs;
+    }
+    if (filter_ctx->pal_sink) {
+        pal_inputs = avfilter_inout_alloc();
+        if (!pal_inputs) {
+            ret = AVERROR(ENOMEM);
+            goto end;
+        }
+        pal_inputs->name = av_strdup("pal");
+        pal_inputs->filter_ctx = filter_ctx->pal_sink;
+        pal_inputs->pad_idx = 0;
+        pal_inputs->next = NULL;
+        inputs->next = pal_inputs;
+    }
+
+    // 解析过滤器字符串，并添加过滤器
+    for (int i = 0; i < filter_ctx->filter_n; i++) {
+        ret = avfilter_graph_parse_ptr(filter_ctx->graph, filter_ctx->filters[i], &inputs, &outputs, NULL);
+        if (ret < 0) {
+            printf("Fail to parse filter '%s'.\n", filter_ctx->filters[i]);
+            goto end;
+        }
+    }
+
+    // 验证过滤器链接
+    ret = avfilter_graph_config(filter_ctx->graph, NULL);
+    if (ret < 0) {
+        printf("Fail to verify filter graph.\n");
+        goto end;
+    }
+
+end:
+    avfilter_inout_free(&outputs);
+    avfilter_inout_free(&inputs);
+
+    return ret;
+}
+
+
+/**
+* 统计过滤图中改变像素格式的scale过滤器（包括协商时自动插入的）个数，即每帧做颜色空间转换的次数。
+* split的所有端口共用同一格式列表，因此palettegen与paletteuse要求的RGB32会一直协商到split之前，
+* 由缩放的scale一并完成转换，正常情况下只有一次。
+*/
+int graph_conversions(const AVFilterGraph* graph)
+{
+    int count = 0;
+    const AVFilterContext* filter;
+
+    for (unsigned i = 0; i < graph->nb_filters; i++) {
+        filter = graph->filters[i];
+        if (!strcmp(filter->filter->name, "scale") && filter->nb_inputs && filter->nb_outputs && \
+            filter->inputs[0]->format != filter->outputs[0]->format) {
+            count++;
+        }
+    }
+
+    return count;
+}
+
+
+/**
+* 由给定参数创建一个新的滤镜结构体。注意使用结束后需要调用filter_free来释放内存。
+*/
+int create_filter(FilterThreadContext** ctx, char** filters, int count, \
+    char* buf_filter_args, char* pal_filter_args, int pal_out, enum AVPixelFormat sink_filter_pix_fmt)
+{
+    FilterThreadContext* filter_ctx;
+
+    // 内存分配
+    filter_ctx = (FilterThreadContext*)malloc(sizeof(FilterThreadContext));
+    if (!filter_ctx) {
+        return AVERROR(ENOMEM);
+    }
+    *ctx = filter_ctx;
+    filter_ctx->graph = NULL;
+    filter_ctx->buf_filter = NULL;
+    filter_ctx->sink_filter = NULL;
+    filter_ctx->pal_filter = NULL;
+    filter_ctx->pal_sink = NULL;
+    filter_ctx->mapper = NULL;
+    filter_ctx->quantizer = NULL;
+    filter_ctx->scaler = NULL;
+    filter_ctx->direct = 0;
+    filter_ctx->filters = filters;
+    filter_ctx->filter_n = count;
+    filter_ctx->buf_args = buf_filter_args;
+    filter_ctx->pal_args = pal_filter_args;
+    filter_ctx->pal_out = pal_out;
+    filter_ctx->sink_fmt = sink_filter_pix_fmt;
+    filter_ctx->scenes = NULL;
+    filter_ctx->scene = -1;
+    filter_ctx->pts_start = 0;
+    filter_ctx->codec = NULL;
+    filter_ctx->differ = NULL;
+    filter_ctx->in_queue = NULL;
+    filter_ctx->out_buffer = NULL;
+    filter_ctx->frame_n = 0;
+    filter_ctx->busy_time = 0;
+    filter_ctx->delta_e = 0;
+
+    return build_graph(filter_ctx);
+}
+
+
+/**
+* 向过滤图的调色板输入端写入固定的调色板并关闭该输入端，之后的所有帧都使用该调色板。
+*/
+int set_palette(FilterThreadContext* ctx, AVFrame* palette)
+{
+    int ret;
+
+    ret = av_buffersrc_add_frame_flags(ctx->pal_filter, palette, AV_BUFFERSRC_FLAG_KEEP_REF);
+    if (ret >= 0) {
+        ret = av_buffersrc_add_frame(ctx->pal_filter, NULL);
+    }
+    if (ret < 0) {
+        printf("Fail to set palette.\n");
+    }
+
+    return ret;
+}
+
+
+/**
+* 切换到另一场景的调色板。paletteuse只会载入第一个调色板，因此需要重建过滤图；使用颜色映射器时则无需处理。
+*/
+int switch_scene(FilterThreadContext* td, int scene)
+{
+    int ret;
+
+    if (td->mapper) {
+        td->scene = scene;
+        return 0;
+    }
+    avfilter_graph_free(&td->graph);
+    ret = build_graph(td);
+    if (ret >= 0) {
+        ret = set_palette(td, td->scenes[scene].palette);
+    }
+    td->scene = (ret >= 0) ? scene : -1;
+
+    return ret;
+}
+
+
+/**
+* 由颜色映射器将过滤图输出的RGB32图像映射为PAL8图像。调色板由内置量化器逐帧生成，或来自过滤图的调色板输出端，
+* 或为预先生成的场景调色板。
+*/
+int map_colors(FilterThreadContext* td, FrameMessage* msg)
+{
+    int ret = 0;
+    uint32_t colors[256];
+    AVFrame* palette = NULL, * out = NULL;
+
+    if (td->quantizer) {
+        ret = quantize_frame(td->quantizer, msg->frame, colors);
+    }
+    else if (td->pal_sink) {
+        palette = av_frame_alloc();
+        ret = palette ? av_buffersink_get_frame(td->pal_sink, palette) : AVERROR(ENOMEM);
+        if (ret >= 0)
+            palette_colors(palette, colors);
+    }
+    else {
+        palette_colors(td->scenes[msg->scene].palette, colors);
+    }
+    if (ret >= 0) {
+        ret = map_frame(td->mapper, msg->frame, colors, &out);
+    }
+    if (ret >= 0) {
+        if (td->quantizer)
+            td->delta_e += quant_error(td->quantizer, msg->frame, out);
+        av_frame_free(&msg->frame);
+        msg->frame = out;
+    }
+    av_frame_free(&palette);
+
+    return ret;
+}
+
+
+/**
+* 不经过过滤图，由直接转换路径将msg中的帧转换为PAL8帧。帧的尺寸或色彩参数改变时重新分配行缓存。
+*/
+int direct_colors(FilterThreadContext* td, FrameMessage* msg)
+{
+    int ret;
+    uint32_t colors[256];
+    AVFrame* out = NULL;
+    DirectScaler* scaler = td->scaler;
+
+    if (scaler && (scaler->src_w != msg->frame->width || scaler->src_h != msg->frame->height || \
+        scaler->format != msg->frame->format || scaler->colorspace != msg->frame->colorspace || \
+        scaler->range != msg->frame->color_range)) {
+        scaler_free(&td->scaler);
+    }
+    if (!td->scaler) {
+        td->scaler = scaler_alloc(msg->frame, (*td->sink_filter->inputs)->w, (*td->sink_filter->inputs)->h);
+        if (!td->scaler) {
+            return AVERROR(ENOMEM);
+        }
+    }
+    palette_colors(td->scenes[msg->scene].palette, colors);
+    ret = direct_frame(td->scaler, td->mapper, msg->frame, colors, &out);
+    if (ret >= 0) {
+        av_frame_free(&msg->frame);
+        msg->frame = out;
+    }
+
+    return ret;
+}
+
+
+/**
+* 将msg中的帧送入过滤图，需要时再由颜色映射器映射为PAL8帧。
+*/
+int graph_colors(FilterThreadContext* td, FrameMessage* msg)
+{
+    int ret;
+
+    ret = av_buffersrc_add_frame(td->buf_filter, msg->frame);
+    if (ret >= 0) {
+        ret = av_buffersink_get_frame(td->sink_filter, msg->frame);
+    }
+    if (ret >= 0 && td->mapper) {
+        ret = map_colors(td, msg);
+    }
+
+    return ret;
+}
+
+
+/**
+* 将msg中的帧送入过滤图（或直接转换路径），并由本线程的编码器编码，结果写回msg。
+*/
+void filter_frame(FilterThreadContext* td, FrameMessage* msg)
+{
+    int64_t pts, start_time;
+    int ret, hint[4], src_w, src_h, has_hint;
+
+    start_time = av_gettime_relative();
+    pts = msg->frame->pts;
+    src_w = msg->frame->width;
+    src_h = msg->frame->height;
+    has_hint = td->differ && motion_rect(msg->frame, hint);
+    ret = (td->scenes && msg->scene != td->scene) ? switch_scene(td, msg->scene) : 0;
+    if (ret >= 0) {
+        ret = (td->direct && direct_supported(msg->frame, (*td->sink_filter->inputs)->w, \
+            (*td->sink_filter->inputs)->h)) ? direct_colors(td, msg) : graph_colors(td, msg);
+    }
+    if (ret >= 0) {
+        msg->packet = av_packet_alloc();
+        ret = msg->packet ? 0 : AVERROR(ENOMEM);
+    }
+    if (ret >= 0) {
+        msg->frame->pts = (int64_t)(td->pts_factor * (pts - td->pts_start));    // 手动设置时间戳
+#ifdef DEBUG
+        printf("Filt-%d: frame %I64d - %s (%d)\n", td->id, msg->frame->pts, av_err2str(ret), ret);
+#endif
+        if (has_hint) {
+            // 将运动矢量给出的区域换算到输出尺寸，向外取整
+            hint[2] = (int)(((int64_t)(hint[0] + hint[2]) * msg->frame->width + src_w - 1) / src_w);
+            hint[3] = (int)(((int64_t)(hint[1] + hint[3]) * msg->frame->height + src_h - 1) / src_h);
+            hint[0] = (int)((int64_t)hint[0] * msg->frame->width / src_w);
+            hint[1] = (int)((int64_t)hint[1] * msg->frame->height / src_h);
+            hint[2] -= hint[0];
+            hint[3] -= hint[1];
+        }
+        // 由本线程的编码器完成编码，输出顺序交由复用线程保证
+        ret = td->differ ? encode_changes(td->differ, td->codec, msg->frame, msg->seq, has_hint ? hint : NULL, \
+            msg->packet) : encode_packet(td->codec, msg->frame, msg->packet);
+    }
+    else if (td->differ) {
+        differ_skip(td->differ, msg->seq);
+    }
+    av_frame_free(&msg->frame);
+    msg->ret = ret;
+    td->busy_time += av_gettime_relative() - start_time;
+    td->frame_n++;
+}
+
+
+void* filting(void* arg)
+{
+    FilterThreadContext* td = (FilterThreadContext*)arg;
+    FrameMessage msg;
+    int ret;
+    
+    while (1) {
+        // 从共享队列中取帧，队列被关闭且为空时退出
+        ret = av_thread_message_queue_recv(td->in_queue, &msg, 0);
+        if (ret < 0) {
+            break;
+        }
+#ifdef DEBUG
+        printf("Filt-%d:  Receive frame #%I64d\n", td->id, msg.seq);
+#endif
+        filter_frame(td, &msg);
+        // 无论成功与否都要写入结果，否则复用线程会一直等待该序号
+        ret = reorder_put(td->out_buffer, &msg);
+        if (ret < 0) {
+            message_free(&msg);
+            break;
+        }
+    };
+    
+    return NULL;
+}
+
+
+#ifdef BENCHMARK
+/**
+* 以1920x1080的合成YUV420P图像比较过滤图路径（scale转RGB32后由颜色映射器映射）与直接转换路径的速度，输出宽度为480。
+*/
+void benchmark_direct()
+{
+    const int width = 1920, height = 1080, dst_w = 480, rounds = 20;
+    char args[MAX_FILTER_LENTH], filter_str[MAX_FILTER_LENTH], * filter_list[1] = { filter_str };
+    uint32_t colors[256], seed = 12345;
+    int ret;
+    FilterThreadContext* filter = NULL;
+    ColorMapper* mapper = NULL;
+    DirectScaler* scaler = NULL;
+    AVFrame* frame = NULL, * rgb = NULL, * out = NULL;
+    int64_t start_time, graph_time = 0, direct_time = 0;
+
+    frame = av_frame_alloc();
+    rgb = av_frame_alloc();
+    mapper = mapper_alloc();
+    if (!frame || !rgb || !mapper) {
+        goto end;
+    }
+    frame->format = AV_PIX_FMT_YUV420P;
+    frame->width = width;
+    frame->height = height;
+    if (av_frame_get_buffer(frame, 0) < 0) {
+        goto end;
+    }
+    for (int y = 0; y < height; y++) {
+        for (int x = 0; x < width; x++) {
+            frame->data[0][y * frame->linesize[0] + x] = (uint8_t)(16 + (x + y) * 219 / (width + height));
+        }
+    }
+    for (int y = 0; y < height / 2; y++) {
+        for (int x = 0; x < width / 2; x++) {
+            frame->data[1][y * frame->linesize[1] + x] = (uint8_t)(16 + x * 224 / (width / 2));
+            frame->data[2][y * frame->linesize[2] + x] = (uint8_t)(16 + y * 224 / (height / 2));
+        }
+    }
+    for (int i = 0; i < 256; i++) {
+        seed = seed * 1664525 + 1013904223;
+        colors[i] = 0xFF000000 | (seed >> 8);
+    }
+    colors[255] = 0;
+
+    snprintf(args, sizeof(args), "video_size=%dx%d:pix_fmt=%d:time_base=1/25:pixel_aspect=1/1", \
+        width, height, AV_PIX_FMT_YUV420P);
+    snprintf(filter_str, sizeof(filter_str), "[in]scale=%d:-1[out]", dst_w);
+    ret = create_filter(&filter, filter_list, 1, args, NULL, 0, AV_PIX_FMT_RGB32);
+    if (ret < 0) {
+        goto end;
+    }
+    scaler = scaler_alloc(frame, (*filter->sink_filter->inputs)->w, (*filter->sink_filter->inputs)->h);
+    if (!scaler) {
+        goto end;
+    }
+
+    for (int r = 0; r < rounds; r++) {
+        frame->pts = r;
+        start_time = av_gettime_relative();
+        ret = av_buffersrc_add_frame_flags(filter->buf_filter, frame, AV_BUFFERSRC_FLAG_KEEP_REF);
+        if (ret >= 0)
+            ret = av_buffersink_get_frame(filter->sink_filter, rgb);
+        if (ret >= 0)
+            ret = map_frame(mapper, rgb, colors, &out);
+        graph_time += av_gettime_relative() - start_time;
+        av_frame_unref(rgb);
+        av_frame_free(&out);
+        if (ret < 0) {
+            goto end;
+        }
+
+        start_time = av_gettime_relative();
+        ret = direct_frame(scaler, mapper, frame, colors, &out);
+        direct_time += av_gettime_relative() - start_time;
+        av_frame_free(&out);
+        if (ret < 0) {
+            goto end;
+        }
+    }
+    printf("Direct path benchmark (%dx%d -> %dx%d, %d frames):\n", width, height, scaler->dst_w, scaler->dst_h, rounds);
+    printf("  graph   %.2fms/frame\n", graph_time / 1e3 / rounds);
+    printf("  direct  %.2fms/frame\n", direct_time / 1e3 / rounds);
+
+end:
+    filter_free(&filter);
+    mapper_free(&mapper);
+    scaler_free(&scaler);
+    av_frame_free(&frame);
+    av_frame_free(&rgb);
+}
+
+
+/**
+* 计算两个8位平面的平均SSIM，窗口为8x8像素，每次移动4像素。
+*/
+double ssim_plane(const uint8_t* a, int a_stride, const uint8_t* b, int b_stride, int width, int height)
+{
+    const double c1 = (0.01 * 255) * (0.01 * 255), c2 = (0.03 * 255) * (0.03 * 255);
+    double total = 0, ma, mb, va, vb, cov;
+    int64_t sa, sb, saa, sbb, sab;
+    int n = 0, pa, pb;
+
+    for (int y = 0; y + 8 <= height; y += 4) {
+        for (int x = 0; x + 8 <= width; x += 4) {
+            sa = sb = saa = sbb = sab = 0;
+            for (int j = 0; j < 8; j++) {
+                for (int i = 0; i < 8; i++) {
+                    pa = a[(y + j) * a_stride + x + i];
+                    pb = b[(y + j) * b_stride + x + i];
+                    sa += pa;
+                    sb += pb;
+                    saa += pa * pa;
+                    sbb += pb * pb;
+                    sab += pa * pb;
+                }
+            }
+            ma = sa / 64.0;
+            mb = sb / 64.0;
+            va = saa / 64.0 - ma * ma;
+            vb = sbb / 64.0 - mb * mb;
+            cov = sab / 64.0 - ma * mb;
+            total += (2 * ma * mb + c1) * (2 * cov + c2) / ((ma * ma + mb * mb + c1) * (va + vb + c2));
+            n++;
+        }
+    }
+
+    return n ? total / n : 1.0;
+}
+
+
+/**
+* 用同一视频的前若干帧比较默认解码与快速解码（Fast Decode）的速度，以及快速解码的亮度平面相对默认解码的SSIM。
+*/
+void benchmark_decode(const char* src)
+{
+    const int max_frames = 300;
+    DecoderConfig configs[2] = { { 0, 0, .0, 0, .0, 0 }, { 0, 0, .0, 0, .0, 1 } };
+    FileContext* inputs[2] = { NULL, NULL };
+    AVFrame* frames[2] = { NULL, NULL };
+    AVPacket* packet = NULL;
+    int64_t start_time, times[2] = { 0, 0 };
+    double ssim = 0;
+    int ret = 0, frame_n = 0, ssim_n = 0;
+
+    packet = av_packet_alloc();
+    for (int i = 0; i < 2; i++) {
+        frames[i] = av_frame_alloc();
+        if (!frames[i] || read_video(&inputs[i], src, &configs[i]) < 0) {
+            goto end;
+        }
+    }
+    if (!packet) {
+        goto end;
+    }
+
+    // 两个解码器交替各解码一帧，帧序相同，可逐帧比较
+    while (frame_n < max_frames) {
+        for (int i = 0; i < 2 && ret >= 0; i++) {
+            start_time = av_gettime_relative();
+            ret = decode(inputs[i], frames[i], packet);
+            times[i] += av_gettime_relative() - start_time;
+        }
+        if (ret < 0) {
+            break;
+        }
+        if (frames[0]->format == frames[1]->format && frames[0]->width == frames[1]->width && \
+            frames[0]->height == frames[1]->height && reducible_format(frames[0]->format)) {
+            ssim += ssim_plane(frames[0]->data[0], frames[0]->linesize[0], frames[1]->data[0], frames[1]->linesize[0], \
+                frames[0]->width, frames[0]->height);
+            ssim_n++;
+        }
+        av_frame_unref(frames[0]);
+        av_frame_unref(frames[1]);
+        frame_n++;
+    }
+    printf("Decode benchmark (%s, %d frames):\n", avcodec_get_name(inputs[0]->codec->codec_id), frame_n);
+    printf("  default  %.1f fps\n", times[0] > 0 ? frame_n * 1e6 / times[0] : .0);
+    printf("  fast     %.1f fps\n", times[1] > 0 ? frame_n * 1e6 / times[1] : .0);
+    if (ssim_n > 0) {
+        printf("  luma SSIM of fast decode: %.4f\n", ssim / ssim_n);
+    }
+
+end:
+    for (int i = 0; i < 2; i++) {
+        if (inputs[i])
+            file_free(&inputs[i]);
+        av_frame_free(&frames[i]);
+    }
+    av_packet_free(&packet);
+}
+
+
+/**
+* 比较单线程解码与自动线程数下帧级、片级多线程解码的速度，用于验证不同分辨率下的自动线程数是否合适。
+*/
+void benchmark_decode_threads(const char* src)
+{
+    const int max_frames = 300;
+    const char* names[3] = { "single", "auto/frame", "auto/slice" };
+    DecoderConfig configs[3] = { { 1, 0, .0, 0, .0, 0 }, { 0, 1, .0, 0, .0, 0 }, { 0, 2, .0, 0, .0, 0 } };
+    FileContext* input = NULL;
+    AVFrame* frame = NULL;
+    AVPacket* packet = NULL;
+    int64_t start_time, elapsed;
+    int frame_n;
+
+    packet = av_packet_alloc();
+    frame = av_frame_alloc();
+    if (!packet || !frame) {
+        goto end;
+    }
+    for (int i = 0; i < 3; i++) {
+        if (read_video(&input, src, &configs[i]) < 0) {
+            goto end;
+        }
+        if (!i) {
+            printf("Decoder threads benchmark (%s, %dx%d):\n", avcodec_get_name(input->codec->codec_id), \
+                input->codec->width, input->codec->height);
+        }
+        start_time = av_gettime_relative();
+        for (frame_n = 0; frame_n < max_frames && decode(input, frame, packet) >= 0; frame_n++) {
+            av_frame_unref(frame);
+        }
+        elapsed = av_gettime_relative() - start_time;
+        printf("  %-10s  %d thread(s)  %.1f fps\n", names[i], input->codec->thread_count, \
+            elapsed > 0 ? frame_n * 1e6 / elapsed : .0);
+        file_free(&input);
+    }
+
+end:
+    if (input)
+        file_free(&input);
+    av_frame_free(&frame);
+    av_packet_free(&packet);
+}
+#endif
+
+
+/**
+* 解码线程结构体。解码得到的帧被放入共享队列，由空闲的滤镜线程取走处理。
+*/
+typedef struct DecodeThreadContext {
+    FileContext* input;
+    AVThreadMessageQueue* queue;
+    ReorderBuffer* reorder;
+    const ScenePalette* scenes;    // 用于确定每帧所属的场景
+    int scene_n;
+    double pts_start;    // 第一个抽帧时刻
+    double pts_interval;
+    int frame_n;    // 已分发的帧数
+    int decode_n;    // 已解码的帧数
+    int dedup;    // 是否跳过与上一个分发的帧完全相同的帧
+    int dup_n;    // 跳过的重复帧数
+    FrameSampler* sampler;    // 自适应抽帧器，为空时保留所有按间隔抽取的帧
+    int64_t decode_time;    // 解码用时
+    int ret;
+}DecodeThreadContext;
+
+
+/**
+* 为frame申请序号并送入共享队列，frame中的数据被移入消息。scene为上一帧所属的场景，用于加快查找。
+*/
+int dispatch_frame(DecodeThreadContext* td, AVFrame* frame, int* scene)
+{
+    FrameMessage msg;
+    int ret;
+
+    // 申请序号，在途帧过多时阻塞
+    ret = reorder_reserve(td->reorder, &msg.seq);
+    if (ret < 0) {
+        return ret;
+    }
+    msg.frame = av_frame_alloc();
+    if (!msg.frame) {
+        return AVERROR(ENOMEM);
+    }
+    av_frame_move_ref(msg.frame, frame);
+    msg.packet = NULL;
+    msg.scene = *scene = td->scenes ? find_scene(td->scenes, td->scene_n, msg.frame->pts, *scene) : 0;
+    msg.ret = 0;
+    ret = av_thread_message_queue_send(td->queue, &msg, 0);
+    if (ret < 0) {
+        av_frame_free(&msg.frame);
+        return ret;
+    }
+    td->frame_n++;
+
+    return 0;
+}
+
+
+void* decoding(void* arg)
+{
+    DecodeThreadContext* td = (DecodeThreadContext*)arg;
+    AVPacket* packet = NULL;
+    AVFrame* frame = NULL, * last = NULL, * held = NULL;
+    double pts_offset = td->pts_start;
+    int64_t start_time;
+    int ret, scene = 0, held_dup = 0;
+
+    packet = av_packet_alloc();
+    frame = av_frame_alloc();
+    last = av_frame_alloc();
+    held = av_frame_alloc();
+    if (!packet || !frame || !last || !held) {
+        ret = AVERROR(ENOMEM);
+        goto end;
+    }
+
+    while (1) {
+        start_time = av_gettime_relative();
+        ret = decode(td->input, frame, packet);
+        td->decode_time += av_gettime_relative() - start_time;
+        if (ret < 0) {
+            break;
+        }
+        td->decode_n++;
+        if (frame->pts < pts_offset) {
+            continue;
+        }
+        pts_offset += td->pts_interval;
+        // 被自适应抽帧跳过的帧同样暂存，以便在结尾处送出
+        if (td->sampler && !sample_frame(td->sampler, frame)) {
+            av_frame_unref(held);
+            av_frame_move_ref(held, frame);
+            held_dup = 0;
+            continue;
+        }
+        if (td->dedup) {
+            ret = drop_duplicate(last, held, frame);
+            if (ret < 0) {
+                break;
+            }
+            if (ret) {
+                td->dup_n++;
+                held_dup = 1;
+                continue;
+            }
+        }
+        av_frame_unref(held);
+        ret = dispatch_frame(td, frame, &scene);
+        if (ret < 0) {
+            break;
+        }
+    }
+    // 输入结束时送出暂存的最后一个未送出的帧
+    if (ret == AVERROR_EOF && held->buf[0]) {
+        td->dup_n -= held_dup;
+        ret = dispatch_frame(td, held, &scene);
+        ret = (ret < 0) ? ret : AVERROR_EOF;
+    }
+
+end:
+    // 通知滤镜线程与编码线程输入结束
+    av_thread_message_queue_set_err_recv(td->queue, AVERROR_EOF);
+    reorder_close(td->reorder, (ret == AVERROR_EOF) ? 0 : ret);    // 出错时已申请的序号可能不会被写入，需中止编码线程
+    if (packet)
+        av_packet_free(&packet);
+    if (frame)
+        av_frame_free(&frame);
+    av_frame_free(&last);
+    av_frame_free(&held);
+    td->ret = ret;
+
+    return NULL;
+}
+
+
+/**
+* 分段线程结构体。每段拥有独立的解码器、过滤图与编码器，从start_pts对应的关键帧开始处理至下一段的起点。
+*/
+typedef struct SegmentThreadContext {
+    FileContext* input;
+    FilterThreadContext* filter;
+    AVThreadMessageQueue* queue;    // 本段编码好的数据包
+    int64_t start_pts;
+    int64_t end_pts;
+    double pts_offset;
+    double pts_interval;
+    int scene_n;    // 场景数，各场景的调色板位于filter中
+    int dedup;    // 是否跳过与上一个处理的帧完全相同的帧
+    int dup_n;    // 跳过的重复帧数
+    FrameSampler* sampler;    // 自适应抽帧器，为空时保留所有按间隔抽取的帧
+    int ret;
+}SegmentThreadContext;
+
+
+/**
+* 由本段的滤镜处理frame，并将编码好的数据包送入本段的队列，frame中的数据被移入消息。
+*/
+int segment_frame(SegmentThreadContext* td, AVFrame* frame)
+{
+    FrameMessage msg;
+    int ret;
+
+    msg.frame = av_frame_alloc();
+    if (!msg.frame) {
+        return AVERROR(ENOMEM);
+    }
+    av_frame_move_ref(msg.frame, frame);
+    msg.packet = NULL;
+    msg.seq = td->filter->frame_n;
+    msg.scene = td->filter->scenes ? find_scene(td->filter->scenes, td->scene_n, msg.frame->pts, td->filter->scene) : 0;
+    filter_frame(td->filter, &msg);
+    ret = av_thread_message_queue_send(td->queue, &msg, 0);
+    if (ret < 0) {
+        message_free(&msg);
+    }
+
+    return ret;
+}
+
+
+void* segmenting(void* arg)
+{
+    SegmentThreadContext* td = (SegmentThreadContext*)arg;
+    AVPacket* packet = NULL;
+    AVFrame* frame = NULL, * last = NULL, * held = NULL;
+    int ret, held_dup = 0;
+
+    packet = av_packet_alloc();
+    frame = av_frame_alloc();
+    last = av_frame_alloc();
+    held = av_frame_alloc();
+    if (!packet || !frame || !last || !held) {
+        ret = AVERROR(ENOMEM);
+        goto end;
+    }
+
+    // 定位到本段起始的关键帧
+    if (td->start_pts != AV_NOPTS_VALUE) {
+        ret = seek_video(td->input, td->start_pts);
+        if (ret < 0) {
+            goto end;
+        }
+    }
+    td->input->end_pts = td->end_pts;
+
+    while (1) {
+        ret = decode(td->input, frame, packet);
+        if (ret < 0) {
+            break;
+        }
+        if (frame->pts < td->pts_offset) {
+            continue;
+        }
+        td->pts_offset += td->pts_interval;
+        if (td->sampler && !sample_frame(td->sampler, frame)) {
+            av_frame_unref(held);
+            av_frame_move_ref(held, frame);
+            held_dup = 0;
+            continue;
+        }
+        if (td->dedup) {
+            ret = drop_duplicate(last, held, frame);
+            if (ret < 0) {
+                break;
+            }
+            if (ret) {
+                td->dup_n++;
+                held_dup = 1;
+                continue;
+            }
+        }
+        av_frame_unref(held);
+        ret = segment_frame(td, frame);
+        if (ret < 0) {
+            break;
+        }
+    }
+    // 本段结束时送出暂存的最后一个未送出的帧
+    if (ret == AVERROR_EOF && held->buf[0]) {
+        td->dup_n -= held_dup;
+        ret = segment_frame(td, held);
+        ret = (ret < 0) ? ret : AVERROR_EOF;
+    }
+
+end:
+    // 通知复用线程本段结束，出错时将错误一并传递
+    av_thread_message_queue_set_err_recv(td->queue, ret);
+    if (packet)
+        av_packet_free(&packet);
+    if (frame)
+        av_frame_free(&frame);
+    av_frame_free(&last);
+    av_frame_free(&held);
+    td->ret = ret;
+
+    return NULL;
+}
+
+
+/**
+* 复用线程结构体。按序号顺序取回各滤镜线程编码好的数据包，写入输出文件。
+* 分段模式下reorder为空，依次从各段的队列中取出数据包，从而将各段按顺序拼接。
+*/
+typedef struct MuxThreadContext {
+    FileContext* output;
+    AVThreadMessageQueue** queues;
+    int queue_n;
+    ReorderBuffer* reorder;
+    int frame_n;    // 已写入的帧数
+    int ret;
+}MuxThreadContext;
+
+
+void* muxing(void* arg)
+{
+    MuxThreadContext* td = (MuxThreadContext*)arg;
+    FrameMessage msg;
+    int ret, q_ptr = 0;
+
+    while (1) {
+        if (td->reorder) {
+            ret = reorder_get(td->reorder, &msg);
+        }
+        else {
+            ret = av_thread_message_queue_recv(td->queues[q_ptr], &msg, 0);
+            if (ret == AVERROR_EOF && q_ptr < td->queue_n - 1) {
+                q_ptr++;    // 当前段已结束，转至下一段
+                continue;
+            }
+        }
+        if (ret < 0) {
+            break;
+        }
+        if (msg.ret >= 0) {
+            ret = write_packet(td->output, msg.packet, td->frame_n);
+            td->frame_n++;
+        }
+        else if (msg.ret != AVERROR(EAGAIN)) {
+            ret = msg.ret;
+        }
+        message_free(&msg);
+        if (ret < 0) {
+            break;
+        }
+    }
+
+    if (ret != AVERROR_EOF) {
+        // 出错时关闭队列与缓冲区，使其他线程尽快退出
+        for (int i = 0; i < td->queue_n; i++) {
+            av_thread_message_queue_set_err_send(td->queues[i], AVERROR_EXIT);
+        }
+        if (td->reorder) {
+            reorder_close(td->reorder, AVERROR_EXIT);
+        }
+    }
+    td->ret = ret;
+
+    return NULL;
+}
+
+
+/**
+* 用于传递gif转码配置的便利结构体。
+*/
+typedef struct ConfigureData {
+    float scale;
+    float speed;
+    int fps;
+    int depth;
+    int thread;
+    int queue;
+    int segment;
+    int batch;
+    int decode_thread;
+    int thread_type;
+    int skip;
+    float start;
+    float duration;
+    int palette;
+    int cache;
+    int mapper;
+    int quantizer;
+    int sample;
+    int direct;
+    int dither;
+    int bayer_scale;
+    int dither_thread;
+    int diff;
+    int dedup;
+    int mvs;
+    int adaptive;
+    int early_scale;
+    int fast;
+}ConfigureData;
+
+
+/**
+* 配置项的取值格式。
+*/
+enum ConfigureType {
+    CONFIG_RATIO,    // 倍率，如x1.0
+    CONFIG_INT,      // 整数
+    CONFIG_BIT,      // 位数，如8bit
+    CONFIG_TIME      // 时间，如1.5s
+};
+
+
+/**
+* 描述ini文件中一行配置的结构体，offset为对应成员在ConfigureData中的偏移。
+*/
+typedef struct ConfigureItem {
+    const char* name;
+    enum ConfigureType type;
+    size_t offset;
+}ConfigureItem;
+
+
+static const ConfigureItem config_items[] = {
+    { "Image Scale", CONFIG_RATIO, offsetof(ConfigureData, scale) },
+    { "Play Speed", CONFIG_RATIO, offsetof(ConfigureData, speed) },
+    { "Frame Rate", CONFIG_INT, offsetof(ConfigureData, fps) },
+    { "Color Depth", CONFIG_BIT, offsetof(ConfigureData, depth) },
+    { "Thread Count", CONFIG_INT, offsetof(ConfigureData, thread) },
+    { "Queue Depth", CONFIG_INT, offsetof(ConfigureData, queue) },
+    { "Segment Count", CONFIG_INT, offsetof(ConfigureData, segment) },
+    { "Batch Jobs", CONFIG_INT, offsetof(ConfigureData, batch) },
+    { "Decode Threads", CONFIG_INT, offsetof(ConfigureData, decode_thread) },
+    { "Thread Type", CONFIG_INT, offsetof(ConfigureData, thread_type) },
+    { "Skip Frames", CONFIG_INT, offsetof(ConfigureData, skip) },
+    { "Start Time", CONFIG_TIME, offsetof(ConfigureData, start) },
+    { "Duration", CONFIG_TIME, offsetof(ConfigureData, duration) },
+    { "Palette Mode", CONFIG_INT, offsetof(ConfigureData, palette) },
+    { "Palette Cache", CONFIG_INT, offsetof(ConfigureData, cache) },
+    { "Color Mapper", CONFIG_INT, offsetof(ConfigureData, mapper) },
+    { "Quantizer", CONFIG_INT, offsetof(ConfigureData, quantizer) },
+    { "Sample Step", CONFIG_INT, offsetof(ConfigureData, sample) },
+    { "Direct Path", CONFIG_INT, offsetof(ConfigureData, direct) },
+    { "Dither", CONFIG_INT, offsetof(ConfigureData, dither) },
+    { "Bayer Scale", CONFIG_INT, offsetof(ConfigureData, bayer_scale) },
+    { "Dither Threads", CONFIG_INT, offsetof(ConfigureData, dither_thread) },
+    { "Frame Diff", CONFIG_INT, offsetof(ConfigureData, diff) },
+    { "Drop Duplicates", CONFIG_INT, offsetof(ConfigureData, dedup) },
+    { "Motion Vectors", CONFIG_INT, offsetof(ConfigureData, mvs) },
+    { "Adaptive Rate", CONFIG_INT, offsetof(ConfigureData, adaptive) },
+    { "Early Downscale", CONFIG_INT, offsetof(ConfigureData, early_scale) },
+    { "Fast Decode", CONFIG_INT, offsetof(ConfigureData, fast) },
+};
+#define CONFIG_N (sizeof(config_items) / sizeof(config_items[0]))
+
+
+/**
+* 解析一个配置项的值，成功时返回0。
+*/
+int parse_config_item(ConfigureData* config, const ConfigureItem* item, const char* value)
+{
+    void* field = (char*)config + item->offset;
+
+    switch (item->type) {
+    case CONFIG_RATIO:
+        return sscanf(value, "x%f", (float*)field) == 1 ? 0 : -1;
+    case CONFIG_INT:
+        return sscanf(value, "%d", (int*)field) == 1 ? 0 : -1;
+    case CONFIG_BIT:
+        return sscanf(value, "%dbit", (int*)field) == 1 ? 0 : -1;
+    case CONFIG_TIME:
+        return sscanf(value, "%fs", (float*)field) == 1 ? 0 : -1;
+    }
+
+    return -1;
+}
+
+
+/**
+* 将一个配置项格式化为"名称\t=\t值"的形式写入buf。
+*/
+int format_config_item(char* buf, size_t size, const ConfigureData* config, const ConfigureItem* item)
+{
+    const void* field = (const char*)config + item->offset;
+
+    switch (item->type) {
+    case CONFIG_RATIO:
+        return snprintf(buf, size, "%s\t=\tx%.1f", item->name, *(const float*)field);
+    case CONFIG_INT:
+        return snprintf(buf, size, "%s\t=\t%d", item->name, *(const int*)field);
+    case CONFIG_BIT:
+        return snprintf(buf, size, "%s\t=\t%dbit", item->name, *(const int*)field);
+    case CONFIG_TIME:
+        return snprintf(buf, size, "%s\t=\t%.2fs", item->name, *(const float*)field);
+    }
+
+    return -1;
+}
+
+
+/**
+* 将全部配置项写出至文件。
+*/
+int write_config(const ConfigureData* config, const char* ini_file)
+{
+    int ret = 0;
+    FILE* fp = NULL;
+    char line[MAX_PATH_LENGTH];
+
+    ret = fopen_s(&fp, ini_file, "w");
+    if (!fp) {
+        printf("Failed to create ini file.\n");
+        return -1;
+    }
+    for (int i = 0; i < CONFIG_N && ret >= 0; i++) {
+        format_config_item(line, sizeof(line), config, &config_items[i]);
+        ret = fprintf(fp, (i < CONFIG_N - 1) ? "%s\n" : "%s", line);
+    }
+    ret = ret > 0 ? 0 : -1;
+    fclose(fp);
+    if (ret < 0) {
+        printf("Failed to write configure to ini file.\n");
+    }
+
+    return ret;
+}
+
+
+/**
+* 从文件中读取转码配置。若文件不存在，则将配置写出至新文件；若文件中缺少部分配置项，
+* 则缺少的项保持默认值，并将完整的配置重新写回文件。
+*/
+int read_config(ConfigureData* config, const char* ini_file)
+{
+    int ret = 0, found = 0;
+    FILE* fp = NULL;
+    char line[MAX_PATH_LENGTH], key[MAX_PATH_LENGTH], value[MAX_PATH_LENGTH];
+    int i;
+
+    if (!_access(ini_file, 0)) {
+        ret = fopen_s(&fp, ini_file, "r");
+        if (fp) {
+            while (ret >= 0 && fgets(line, sizeof(line), fp)) {
+                if (sscanf(line, "%[^\t=]\t=\t%[^\r\n]", key, value) != 2) {
+                    continue;
+                }
+                for (i = 0; i < CONFIG_N; i++) {
+                    if (!strcmp(key, config_items[i].name)) {
+                        break;
+                    }
+                }
+                if (i < CONFIG_N) {
+                    ret = parse_config_item(config, &config_items[i], value);
+                    found++;
+                }
+            }
+            fclose(fp);
+            if (ret < 0 || !found) {
+                ret = -1;
+                printf("Failed to parse configure from ini file.\n");
+                goto end;
+            }
+            if (found < CONFIG_N) {
+                ret = write_config(config, ini_file);
+            }
+        }
+        else {
+            printf("Failed to open ini file.\n");
+            goto end;
+        }
+    }
+    else {
+        ret = write_config(config, ini_file);
+    }
+    if (ret < 0) {
+        goto end;
+    }
+#ifdef DEBUG
+    printf("Configure:\n");
+    for (i = 0; i < CONFIG_N; i++) {
+        format_config_item(line, sizeof(line), config, &config_items[i]);
+        printf("%s\n", line);
+    }
+    printf("\n");
+#endif
+
+end:
+    return ret;
+}
+
+
+/**
+* 生成滤镜输入端的参数。
+*/
+void format_buffer_args(char* args, size_t size, const FileContext* input)
+{
+    snprintf(args, size, \
+        "video_size=%dx%d:pix_fmt=%d:time_base=%d/%d:pixel_aspect=%d/%d", \
+        input->width, input->height, input->codec->pix_fmt, input->st->time_base.num, \
+        input->st->time_base.den, input->st->sample_aspect_ratio.num, input->st->sample_aspect_ratio.den);
+}
+
+
+/**
+* Color Depth对应的调色板项数，含保留的透明色。palettegen与内置量化器都保留最后一项作为透明色，
+* 可用的颜色都比该值少1，两者的颜色预算相同。
+*/
+int palette_size(const ConfigureData* config)
+{
+    return (config->depth >= 8) ? 256 : 256 >> (8 - FFMAX(config->depth, 1));
+}
+
+
+/**
+* 是否使用内置量化器逐帧生成调色板。量化器只代替逐帧模式下的palettegen，且总是配合颜色映射器使用。
+*/
+int use_quantizer(const ConfigureData* config)
+{
+    return config->quantizer && config->palette == 0;
+}
+
+
+/**
+* 是否启用直接转换路径。直接转换路径需要预先生成的调色板，且总是配合颜色映射器使用。
+*/
+int use_direct(const ConfigureData* config)
+{
+    return config->direct && config->palette > 0;
+}
+
+
+/**
+* 是否由内置的颜色映射器代替paletteuse完成颜色映射。
+*/
+int use_mapper(const ConfigureData* config)
+{
+    return config->mapper || use_quantizer(config) || use_direct(config);
+}
+
+
+/**
+* 按配置为滤镜结构体分配颜色映射器与量化器，并设置是否使用直接转换路径。
+*/
+int attach_mapper(FilterThreadContext* filter, const ConfigureData* config)
+{
+    if (use_mapper(config)) {
+        filter->mapper = mapper_alloc();
+        if (!filter->mapper) {
+            return AVERROR(ENOMEM);
+        }
+        mapper_set_dither(filter->mapper, av_clip(config->dither, DITHER_NONE, DITHER_FLOYD_STEINBERG), \
+            config->bayer_scale, config->dither_thread);
+        diffuser_start(filter->mapper);    // 启动失败时串行处理，不影响结果
+    }
+    if (use_quantizer(config)) {
+        filter->quantizer = quantizer_alloc(config->sample, palette_size(config) - 1);
+        if (!filter->quantizer) {
+            return AVERROR(ENOMEM);
+        }
+    }
+    filter->direct = use_direct(config);
+
+    return 0;
+}
+
+
+/**
+* 生成paletteuse的抖动选项，以冒号开头。
+*/
+void format_dither(char* buf, size_t size, const ConfigureData* config)
+{
+    static const char* names[] = { "none", "bayer", "sierra2_4a", "floyd_steinberg" };
+    int dither = av_clip(config->dither, DITHER_NONE, DITHER_FLOYD_STEINBERG);
+
+    if (dither == DITHER_BAYER) {
+        snprintf(buf, size, ":dither=bayer:bayer_scale=%d", av_clip(config->bayer_scale, 0, 5));
+    }
+    else {
+        snprintf(buf, size, ":dither=%s", names[dither]);
+    }
+}
+
+
+/**
+* 根据配置生成滤镜输入端参数args与各滤镜的描述字符串，返回滤镜字符串的个数。filter_list中需预先分配FILTER_N个
+* 长度为MAX_FILTER_LENTH的缓存，new_palette表示是否每帧都使用新生成的调色板。
+* 全局调色板模式下不再生成调色板，而是由名为pal的输入端提供，其参数写入pal_args。
+* 使用颜色映射器时不包含paletteuse，过滤图输出RGB32图像，逐帧生成的调色板由名为pal的输出端给出；
+* 使用内置量化器时也不包含palettegen。
+*/
+int format_filters(char* args, char* pal_args, size_t size, char** filter_list, const FileContext* input, \
+    const ConfigureData* config, int new_palette)
+{
+    int count;
+    char dither[48];
+
+    format_buffer_args(args, size, input);
+    format_dither(dither, sizeof(dither), config);
+    if (use_mapper(config)) {
+        // 由颜色映射器完成颜色映射，过滤图只需输出RGB图像（以及逐帧生成的调色板）
+        if (config->palette > 0 || use_quantizer(config)) {
+            snprintf(filter_list[0], MAX_FILTER_LENTH, "[in]scale=%.0f:-1[out]", \
+                (double)config->scale * input->st->codecpar->width);
+            count = 1;
+        }
+        else {
+            snprintf(filter_list[0], MAX_FILTER_LENTH, "[in]scale=%.0f:-1,split[out][split1]", \
+                (double)config->scale * input->st->codecpar->width);
+            snprintf(filter_list[1], MAX_FILTER_LENTH, "[split1]palettegen=max_colors=%d:reserve_transparent=1:stats_mode=single[pal]", \
+                palette_size(config));
+            count = 2;
+        }
+    }
+    else if (config->palette > 0) {
+        snprintf(pal_args, size, "video_size=16x16:pix_fmt=%d:time_base=%d/%d:pixel_aspect=1/1", \
+            AV_PIX_FMT_RGB32, input->st->time_base.num, input->st->time_base.den);
+        snprintf(filter_list[0], MAX_FILTER_LENTH, "[in]scale=%.0f:-1[scaled]", \
+            (double)config->scale * input->st->codecpar->width);
+        snprintf(filter_list[1], MAX_FILTER_LENTH, "[scaled][pal]paletteuse=new=0%s[out]", dither);
+        count = 2;
+    }
+    else {
+        snprintf(filter_list[0], MAX_FILTER_LENTH, "[in]scale=%.0f:-1,split[split1][split2]", \
+            (double)config->scale * input->st->codecpar->width);
+        snprintf(filter_list[1], MAX_FILTER_LENTH, "[split1]palettegen=max_colors=%d:reserve_transparent=1:stats_mode=single[pal]", \
+            palette_size(config));
+        snprintf(filter_list[2], MAX_FILTER_LENTH, "[split2][pal]paletteuse=new=%d%s[out]", \
+            new_palette, dither);
+        count = 3;
+    }
+#ifdef DEBUG
+    printf("\nFilter Input:\n%s\n", args);
+    printf("\nFliter String:\n");
+    for (int i = 0; i < count; i++)
+        printf("%s\n", filter_list[i]);
+#endif
+
+    return count;
+}
+
+
+/**
+* 统计RGB32图像的颜色直方图，每个通道取高3位，共512格。
+*/
+void color_histogram(const AVFrame* frame, int* hist)
+{
+    const uint8_t* p;
+
+    memset(hist, 0, 512 * sizeof(int));
+    for (int y = 0; y < frame->height; y++) {
+        p = frame->data[0] + y * frame->linesize[0];
+        for (int x = 0; x < frame->width; x++, p += 4) {
+            hist[(p[2] >> 5) << 6 | (p[1] >> 5) << 3 | p[0] >> 5]++;
+        }
+    }
+}
+
+
+/**
+* 结束当前场景的颜色统计，将palettegen输出的调色板追加到场景列表中。
+*/
+int finish_scene(FilterThreadContext** gen, int64_t pts, ScenePalette** scenes, int* count)
+{
+    int ret;
+    AVFrame* palette;
+    ScenePalette* list;
+
+    palette = av_frame_alloc();
+    list = (ScenePalette*)av_realloc_array(*scenes, *count + 1, sizeof(ScenePalette));
+    if (!palette || !list) {
+        av_frame_free(&palette);
+        return AVERROR(ENOMEM);
+    }
+    *scenes = list;
+    ret = av_buffersrc_add_frame((*gen)->buf_filter, NULL);
+    if (ret >= 0) {
+        ret = av_buffersink_get_frame((*gen)->sink_filter, palette);
+    }
+    if (ret < 0) {
+        printf("Fail to generate palette.\n");
+        av_frame_free(&palette);
+        return ret;
+    }
+    list[*count].pts = pts;
+    list[*count].palette = palette;
+    (*count)++;
+    filter_free(gen);
+
+    return 0;
+}
+
+
+/**
+* 预先生成调色板的第一遍扫描：将[start_pts, end_pts)范围内每秒PALETTE_SCAN_FPS帧缩小至固定宽度后统计全部颜色（stats_mode=full）。
+* 抽帧间隔与缩小后的宽度只取决于源视频，与输出的缩放、帧率及倍速无关，因此修改这些设置后调色板缓存仍然有效。
+* detect_scene为0时整段只生成一个全局调色板；否则比较相邻帧的颜色直方图，在场景切换处结束统计并开始新的调色板。
+* 扫描结束后回到start_pts处，以便第二遍从头解码。scenes使用结束后需要调用scenes_free释放。
+*/
+int scan_scenes(FileContext* input, const ConfigureData* config, int64_t start_pts, int64_t end_pts, \
+    int detect_scene, ScenePalette** scenes, int* scene_n)
+{
+    int ret = 0, frame_n = 0, size;
+    FilterThreadContext* scan = NULL, * gen = NULL;
+    AVPacket* packet = NULL;
+    AVFrame* frame = NULL;
+    int* hist = NULL, * last_hist, diff;
+    double pts_offset = start_pts, pts_interval = 1 / (av_q2d(input->st->time_base) * PALETTE_SCAN_FPS);
+    int64_t saved_end_pts = input->end_pts, scene_pts = start_pts, start_time;
+    enum AVDiscard saved_skip_frame = input->codec->skip_frame;
+    int saved_skip_nonref = input->skip_nonref;
+
+    char scan_args[MAX_FILTER_LENTH] = { 0 }, gen_args[MAX_FILTER_LENTH] = { 0 };
+    char scan_str[MAX_FILTER_LENTH] = { 0 }, gen_str[MAX_FILTER_LENTH] = { 0 };
+    char* scan_list[1] = { scan_str }, * gen_list[1] = { gen_str };
+
+    *scenes = NULL;
+    *scene_n = 0;
+    start_time = av_gettime_relative();
+
+    // 缩小图像的过滤图，以及对缩小后的图像统计颜色的过滤图
+    format_buffer_args(scan_args, sizeof(scan_args), input);
+    snprintf(scan_str, sizeof(scan_str), "[in]scale=%d:-1:flags=fast_bilinear[out]", \
+        FFMIN(input->st->codecpar->width, PALETTE_SCAN_WIDTH));
+    ret = create_filter(&scan, scan_list, 1, scan_args, NULL, 0, AV_PIX_FMT_RGB32);
+    if (ret < 0) {
+        goto end;
+    }
+    snprintf(gen_args, sizeof(gen_args), "video_size=%dx%d:pix_fmt=%d:time_base=%d/%d:pixel_aspect=1/1", \
+        (*scan->sink_filter->inputs)->w, (*scan->sink_filter->inputs)->h, AV_PIX_FMT_RGB32, \
+        input->st->time_base.num, input->st->time_base.den);
+    snprintf(gen_str, sizeof(gen_str), "[in]palettegen=max_colors=%d:reserve_transparent=1:stats_mode=full[out]", \
+        palette_size(config));
+
+    packet = av_packet_alloc();
+    frame = av_frame_alloc();
+    hist = (int*)malloc(2 * 512 * sizeof(int));
+    if (!packet || !frame || !hist) {
+        ret = AVERROR(ENOMEM);
+        goto end;
+    }
+    last_hist = hist + 512;
+
+    ret = seek_video(input, start_pts);
+    if (ret < 0) {
+        goto end;
+    }
+    input->end_pts = end_pts;
+    // 按倍速与帧率跳过非参考帧会使参与统计的帧随设置而变，扫描时解码全部帧，保证同一缓存键对应相同的调色板
+    input->codec->skip_frame = AVDISCARD_DEFAULT;
+    input->skip_nonref = 0;
+    while ((ret = decode(input, frame, packet)) >= 0) {
+        if (frame->pts < pts_offset) {
+            continue;
+        }
+        pts_offset += pts_interval;
+        ret = av_buffersrc_add_frame(scan->buf_filter, frame);
+        if (ret >= 0) {
+            ret = av_buffersink_get_frame(scan->sink_filter, frame);
+        }
+        if (ret < 0) {
+            break;
+        }
+
+        // 直方图差异（归一化的L1距离）超过阈值时开始新的场景
+        if (detect_scene) {
+            color_histogram(frame, hist);
+            if (gen) {
+                size = frame->width * frame->height;
+                diff = 0;
+                for (int i = 0; i < 512; i++) {
+                    diff += abs(hist[i] - last_hist[i]);
+                }
+                if (size > 0 && diff > 2 * SCENE_THRESHOLD * size) {
+                    ret = finish_scene(&gen, scene_pts, scenes, scene_n);
+                    if (ret < 0) {
+                        break;
+                    }
+                    scene_pts = frame->pts;
+                }
+            }
+            memcpy(last_hist, hist, 512 * sizeof(int));
+        }
+        if (!gen) {
+            ret = create_filter(&gen, gen_list, 1, gen_args, NULL, 0, AV_PIX_FMT_RGB32);
+            if (ret < 0) {
+                break;
+            }
+        }
+        ret = av_buffersrc_add_frame(gen->buf_filter, frame);
+        if (ret >= 0) {
+            // 取一次输出以驱动过滤图处理该帧，统计阶段不会有输出
+            ret = av_buffersink_get_frame(gen->sink_filter, frame);
+        }
+        if (ret < 0 && ret != AVERROR(EAGAIN)) {
+            break;
+        }
+        frame_n++;
+    }
+    if (ret != AVERROR_EOF) {
+        printf("Fail to scan input file.\n");
+        goto end;
+    }
+    if (!gen) {
+        printf("No frame is found in input file.\n");
+        ret = AVERROR_INVALIDDATA;
+        goto end;
+    }
+    ret = finish_scene(&gen, scene_pts, scenes, scene_n);
+    if (ret < 0) {
+        goto end;
+    }
+    (*scenes)[0].pts = INT64_MIN;    // 第一个调色板也用于起点之前的帧
+    printf("%d palette(s) generated from %d frames in %.2fs.\n\n", *scene_n, frame_n, \
+        (av_gettime_relative() - start_time) / 1e6);
+
+    input->end_pts = saved_end_pts;
+    input->codec->skip_frame = saved_skip_frame;
+    input->skip_nonref = saved_skip_nonref;
+    ret = seek_video(input, start_pts);
+
+end:
+    input->end_pts = saved_end_pts;
+    input->codec->skip_frame = saved_skip_frame;
+    input->skip_nonref = saved_skip_nonref;
+    if (ret < 0) {
+        scenes_free(scenes, *scene_n);
+        *scene_n = 0;
+    }
+    if (packet)
+        av_packet_free(&packet);
+    if (frame)
+        av_frame_free(&frame);
+    if (hist)
+        free(hist);
+    if (scan)
+        filter_free(&scan);
+    if (gen)
+        filter_free(&gen);
+    return ret;
+}
+
+
+/**
+* 计算调色板缓存的键，写入key（32位十六进制字符串）。键由源文件大小、视频流参数、截取范围起点后若干个数据包的内容，
+* 以及影响调色板的设置（色彩深度、调色板模式、场景切换阈值）共同决定，与输出的缩放、帧率及倍速无关。
+* 计算结束后回到start_pts处。
+*/
+int palette_key(FileContext* input, const ConfigureData* config, int64_t start_pts, int64_t end_pts, char* key)
+{
+    int ret, packet_n = 0;
+    struct AVMD5* md5;
+    AVPacket* packet;
+    uint8_t digest[16];
+    int64_t values[7];
+    int settings[3];
+
+    md5 = av_md5_alloc();
+    packet = av_packet_alloc();
+    if (!md5 || !packet) {
+        ret = AVERROR(ENOMEM);
+        goto end;
+    }
+    av_md5_init(md5);
+
+    values[0] = input->fmt->pb ? avio_size(input->fmt->pb) : 0;
+    values[1] = input->st->duration;
+    values[2] = input->st->codecpar->width;
+    values[3] = input->st->codecpar->height;
+    values[4] = input->codec->codec_id;
+    values[5] = start_pts;
+    values[6] = end_pts;
+    settings[0] = config->depth;
+    settings[1] = config->palette;
+    settings[2] = (int)(SCENE_THRESHOLD * 1000);
+    av_md5_update(md5, (const uint8_t*)values, sizeof(values));
+    av_md5_update(md5, (const uint8_t*)settings, sizeof(settings));
+    if (input->reduce) {
+        // 解码后缩小的图像与原图略有差别，生成的调色板单独缓存
+        av_md5_update(md5, (const uint8_t*)&input->reduce, sizeof(input->reduce));
+    }
+    if (config->fast) {
+        // 快速解码跳过了环路滤波与IDCT，图像与正常解码有明显差别
+        av_md5_update(md5, (const uint8_t*)&config->fast, sizeof(config->fast));
+    }
+    if (input->st->codecpar->extradata) {
+        av_md5_update(md5, input->st->codecpar->extradata, input->st->codecpar->extradata_size);
+    }
+
+    // 只读取数据包而不解码，作为内容的指纹
+    ret = seek_video(input, start_pts);
+    if (ret < 0) {
+        goto end;
+    }
+    while (packet_n < PALETTE_KEY_PACKETS && (ret = av_read_frame(input->fmt, packet)) >= 0) {
+        if (packet->stream_index == input->st->index) {
+            av_md5_update(md5, packet->data, packet->size);
+            packet_n++;
+        }
+        av_packet_unref(packet);
+    }
+    if (ret < 0 && ret != AVERROR_EOF) {
+        goto end;
+    }
+    av_md5_final(md5, digest);
+    for (int i = 0; i < 16; i++) {
+        snprintf(key + 2 * i, 3, "%02x", digest[i]);
+    }
+    ret = seek_video(input, start_pts);
+
+end:
+    av_packet_free(&packet);
+    av_free(md5);
+    return ret;
+}
+
+
+/**
+* 从缓存文件中读取各场景的调色板。文件依次为场景数，以及每个场景的起始时间戳与256个颜色。
+*/
+int read_palette_cache(const char* path, ScenePalette** scenes, int* scene_n)
+{
+    int ret = 0, count = 0;
+    FILE* fp = NULL;
+    ScenePalette* list;
+    AVFrame* palette;
+
+    *scenes = NULL;
+    *scene_n = 0;
+    if (_access(path, 4) || fopen_s(&fp, path, "rb") || !fp) {
+        return AVERROR(ENOENT);
+    }
+    if (fread(&count, sizeof(int), 1, fp) != 1 || count <= 0 || count > (1 << 16)) {
+        ret = AVERROR_INVALIDDATA;
+        goto end;
+    }
+    list = (ScenePalette*)av_calloc(count, sizeof(ScenePalette));
+    if (!list) {
+        ret = AVERROR(ENOMEM);
+        goto end;
+    }
+    *scenes = list;
+    for (int i = 0; i < count; i++) {
+        palette = av_frame_alloc();
+        if (!palette) {
+            ret = AVERROR(ENOMEM);
+            goto end;
+        }
+        list[i].palette = palette;
+        (*scene_n)++;
+        palette->format = AV_PIX_FMT_RGB32;
+        palette->width = 16;
+        palette->height = 16;
+        ret = av_frame_get_buffer(palette, 0);
+        if (ret < 0) {
+            goto end;
+        }
+        if (fread(&list[i].pts, sizeof(int64_t), 1, fp) != 1) {
+            ret = AVERROR_INVALIDDATA;
+            goto end;
+        }
+        for (int y = 0; y < 16; y++) {
+            if (fread(palette->data[0] + y * palette->linesize[0], sizeof(uint32_t), 16, fp) != 16) {
+                ret = AVERROR_INVALIDDATA;
+                goto end;
+            }
+        }
+    }
+
+end:
+    fclose(fp);
+    if (ret < 0) {
+        scenes_free(scenes, *scene_n);
+        *scene_n = 0;
+    }
+    return ret;
+}
+
+
+/**
+* 便利函数，将相对于文件夹dir的路径path转换为完整路径。
+*/
+void join_path(char* full_path, const char* dir, const char* path)
+{
+    if (path[0] == '\\' || path[0] == '/' || (path[0] && path[1] == ':')) {
+        strcpy_s(full_path, MAX_PATH_LENGTH, path);
+    }
+    else {
+        snprintf(full_path, MAX_PATH_LENGTH, "%s%s", dir, path);
+    }
+}
+
+
+/**
+* 比较两个缓存文件的写入时间，用于按从早到晚排序。
+*/
+int compare_cache_file(const void* a, const void* b)
+{
+    const struct _finddata_t* fa = (const struct _finddata_t*)a, * fb = (const struct _finddata_t*)b;
+
+    return (fa->time_write > fb->time_write) - (fa->time_write < fb->time_write);
+}
+
+
+/**
+* 缓存文件超过PALETTE_CACHE_MAX个时，删除最早写入的文件。正被其他任务读取而无法删除的文件留待下次清理。
+*/
+void prune_palette_cache()
+{
+    struct _finddata_t entry, * files = NULL, * tmp;
+    intptr_t handle;
+    int count = 0, size = 0;
+    char pattern[MAX_PATH_LENGTH], path[MAX_PATH_LENGTH];
+
+    join_path(pattern, PALETTE_CACHE_DIR, "*.pal");
+    handle = _findfirst(pattern, &entry);
+    if (handle == -1) {
+        return;
+    }
+    do {
+        if (count == size) {
+            size = size ? size * 2 : PALETTE_CACHE_MAX + 16;
+            tmp = (struct _finddata_t*)realloc(files, size * sizeof(struct _finddata_t));
+            if (!tmp) {
+                break;
+            }
+            files = tmp;
+        }
+        files[count++] = entry;
+    } while (!_findnext(handle, &entry));
+    _findclose(handle);
+    if (count > PALETTE_CACHE_MAX) {
+        qsort(files, count, sizeof(struct _finddata_t), compare_cache_file);
+        for (int i = 0; i < count - PALETTE_CACHE_MAX; i++) {
+            join_path(path, PALETTE_CACHE_DIR, files[i].name);
+            remove(path);
+        }
+    }
+    free(files);
+}
+
+
+/**
+* 将各场景的调色板写入缓存文件。先写入临时文件再替换，避免同时运行的任务读到不完整的文件。
+*/
+int write_palette_cache(const char* path, const ScenePalette* scenes, int scene_n)
+{
+    int ret = 0;
+    FILE* fp = NULL;
+    char tmp_path[MAX_PATH_LENGTH];
+
+    _mkdir(PALETTE_CACHE_DIR);
+    snprintf(tmp_path, sizeof(tmp_path), "%s.%lu.tmp", path, (unsigned long)GetCurrentThreadId());
+    if (fopen_s(&fp, tmp_path, "wb") || !fp) {
+        printf("Failed to write palette cache.\n");
+        return AVERROR(EIO);
+    }
+    if (fwrite(&scene_n, sizeof(int), 1, fp) != 1) {
+        ret = AVERROR(EIO);
+    }
+    for (int i = 0; ret >= 0 && i < scene_n; i++) {
+        if (fwrite(&scenes[i].pts, sizeof(int64_t), 1, fp) != 1) {
+            ret = AVERROR(EIO);
+        }
+        for (int y = 0; ret >= 0 && y < 16; y++) {
+            if (fwrite(scenes[i].palette->data[0] + y * scenes[i].palette->linesize[0], sizeof(uint32_t), 16, fp) != 16) {
+                ret = AVERROR(EIO);
+            }
+        }
+    }
+    fclose(fp);
+    if (ret >= 0 && !MoveFileEx(tmp_path, path, MOVEFILE_REPLACE_EXISTING)) {
+        ret = AVERROR(EIO);
+    }
+    if (ret < 0) {
+        remove(tmp_path);
+        printf("Failed to write palette cache.\n");
+    }
+    else {
+        prune_palette_cache();
+    }
+
+    return ret;
+}
+
+
+/**
+* 获取[start_pts, end_pts)范围内各场景的调色板。启用缓存时优先从缓存中读取，未命中时再扫描生成并写入缓存。
+* hit_n与miss_n分别累计缓存命中与未命中的次数。
+*/
+int load_scenes(FileContext* input, const ConfigureData* config, int64_t start_pts, int64_t end_pts, \
+    ScenePalette** scenes, int* scene_n, int* hit_n, int* miss_n)
+{
+    int ret;
+    char key[37] = { 0 };
+    char path[MAX_PATH_LENGTH];
+
+    if (config->cache) {
+        ret = palette_key(input, config, start_pts, end_pts, key);
+        if (ret < 0) {
+            return ret;
+        }
+        strcat_s(key, sizeof(key), ".pal");
+        join_path(path, PALETTE_CACHE_DIR, key);
+        if (read_palette_cache(path, scenes, scene_n) >= 0) {
+            (*hit_n)++;
+            printf("%d palette(s) loaded from cache.\n\n", *scene_n);
+            return 0;
+        }
+        (*miss_n)++;
+    }
+    ret = scan_scenes(input, config, start_pts, end_pts, config->palette == 2, scenes, scene_n);
+    if (ret >= 0 && config->cache) {
+        write_palette_cache(path, *scenes, *scene_n);    // 写入失败不影响本次转码
+    }
+
+    return ret;
+}
+
+
+/**
+* 单次转码的统计信息。
+*/
+typedef struct ProcessStats {
+    int frame_n;        // 写入GIF的帧数
+    int64_t elapsed;    // 转码用时（微秒）
+    int cache_hit;      // 调色板缓存命中次数
+    int cache_miss;     // 调色板缓存未命中次数
+}ProcessStats;
+
+
+/**
+* 按照config指定的配置，将视频文件src转换为GIF格式的新文件dst。stats不为空时写入统计信息。
+*/
+int video2gif(const char* src, const char* dst, ConfigureData* config, ProcessStats* stats)
+{
+    int ret = 0, thread_n = 0, worker_n = 0, segment_n = 1, independent, seg_frames;
+    FileContext* input = NULL, * output = NULL;
+    FilterThreadContext** filter = NULL;
+    AVThreadMessageQueue* queue = NULL;
+    AVThreadMessageQueue** seg_queues = NULL;
+    ReorderBuffer* reorder = NULL;
+    FrameHistory* history = NULL;
+    SegmentThreadContext* seg_ctx = NULL;
+    int64_t* bounds = NULL;
+    pthread_t* threads = NULL;
+    pthread_t dec_thread, mux_thread;
+    int dec_started = 0, mux_started = 0;
+    DecodeThreadContext dec_ctx = { 0 };
+    MuxThreadContext mux_ctx = { 0 };
+    double pts_factor;
+    double pts_interval;
+    double sample_interval;
+    double delta_e = 0;
+    int64_t rect_area = 0, frame_area = 0, hint_area = 0;
+    int dup_n = 0, kept_n = 0, candidate_n = 0;
+    int conversion_n;
+#ifdef DEBUG
+    char* graph_dump;
+#endif
+    int64_t start_pts = 0, end_pts = INT64_MAX;
+    int64_t start_time, elapsed;
+    DecoderConfig dec_config = { config->decode_thread, config->thread_type, \
+        config->skip ? (double)config->fps * config->speed * (config->adaptive ? ADAPTIVE_RATIO : 1) : .0, \
+        config->mvs && (config->diff || config->dedup), config->early_scale ? config->scale : .0, config->fast };
+
+    ScenePalette* scenes = NULL;
+    int scene_n = 0, cache_hit = 0, cache_miss = 0;
+
+    char filter_args[MAX_FILTER_LENTH] = { 0 };
+    char pal_args[MAX_FILTER_LENTH] = { 0 };
+    char* filter_list[FILTER_N] = { NULL };
+    int filter_n;
+    enum AVPixelFormat pixel_fmt = AV_PIX_FMT_PAL8;
+
+    // 打开输入文件
+    ret = read_video(&input, src, &dec_config);
+    if (ret < 0) {
+        goto end;
+    }
+    av_dump_format(input->fmt, input->st->index, src, 0);
+    printf("\n");
+
+    // 计算截取范围，只解码从起点之前最近的关键帧到终点之间的部分
+    if (config->start > 0) {
+        start_pts = ((input->st->start_time != AV_NOPTS_VALUE) ? input->st->start_time : 0) + \
+            av_rescale_q((int64_t)(config->start * AV_TIME_BASE), AV_TIME_BASE_Q, input->st->time_base);
+    }
+    if (config->duration > 0) {
+        end_pts = ((config->start > 0) ? start_pts : \
+            ((input->st->start_time != AV_NOPTS_VALUE) ? input->st->start_time : 0)) + \
+            av_rescale_q((int64_t)(config->duration * AV_TIME_BASE), AV_TIME_BASE_Q, input->st->time_base);
+    }
+    if (config->start > 0 || config->duration > 0) {
+        printf("Clip: %.2fs - %.2fs.\n\n", (double)config->start, \
+            (config->duration > 0) ? (double)(config->start + config->duration) : av_q2d(input->st->time_base) * \
+            ((input->st->duration != AV_NOPTS_VALUE) ? input->st->duration : 0));
+    }
+
+    // 按关键帧划分分段，每段由一个线程独立完成解码、滤镜与编码
+    if (config->segment > 1) {
+        ret = find_segments(input, config->segment, (config->start > 0) ? start_pts : AV_NOPTS_VALUE, end_pts, &bounds);
+        if (ret < 0) {
+            goto end;
+        }
+        segment_n = ret;
+        printf("Split input into %d segment(s).\n\n", segment_n);
+    }
+    else {
+        if (config->start > 0) {
+            ret = seek_video(input, start_pts);
+            if (ret < 0) {
+                goto end;
+            }
+        }
+        input->end_pts = end_pts;
+    }
+    worker_n = (segment_n > 1) ? segment_n : config->thread;
+    independent = worker_n > 1;
+
+    // 设置滤镜输入端参数与滤镜的描述字符串
+    for (int i = 0; i < FILTER_N; i++) {
+        filter_list[i] = (char*)malloc(MAX_FILTER_LENTH * sizeof(char));
+        if (!filter_list[i]) {
+            ret = AVERROR(ENOMEM);
+            goto end;
+        }
+    }
+    filter_n = format_filters(filter_args, pal_args, sizeof(filter_args), filter_list, input, config, independent);
+
+    // 创建滤镜
+    filter = (FilterThreadContext**)calloc(worker_n, sizeof(FilterThreadContext*));
+    if (!filter) {
+        ret = AVERROR(ENOMEM);
+        goto end;
+    }
+    for (int i = 0; i < worker_n; i++) {
+        ret = create_filter(&filter[i], filter_list, filter_n, filter_args, \
+            (config->palette > 0 && !use_mapper(config)) ? pal_args : NULL, \
+            use_mapper(config) && config->palette == 0 && !use_quantizer(config), \
+            use_mapper(config) ? AV_PIX_FMT_RGB32 : pixel_fmt);
+        if (ret >= 0) {
+            ret = attach_mapper(filter[i], config);
+        }
+        if (ret < 0) {
+            goto end;
+        }
+    }
+    conversion_n = graph_conversions(filter[0]->graph);
+#ifdef DEBUG
+    graph_dump = avfilter_graph_dump(filter[0]->graph, NULL);
+    printf("\nFilter Graph:\n%s\n", graph_dump);
+    printf("Pixel format conversions per frame: %d\n", conversion_n);
+    av_free(graph_dump);
+#endif
+    if (conversion_n > 1) {
+        printf("Warning: filter graph converts pixel format %d times per frame.\n", conversion_n);
+    }
+    
+    // 打开输出文件
+    ret = write_gif(&output, dst, (*filter[0]->sink_filter->inputs)->w, (*filter[0]->sink_filter->inputs)->h, \
+        pixel_fmt, config->thread);
+    if (ret < 0) {
+        goto end;
+    }
+    output->st->avg_frame_rate = (AVRational){ config->fps, 1 };
+    av_dump_format(output->fmt, 0, dst, 1);
+    printf("\n");
+
+    // 为每个滤镜线程创建独立的编码器，多线程时各帧需能够被独立编码，以便任意线程处理任意帧
+    for (int i = 0; i < worker_n; i++) {
+        ret = open_encoder(&filter[i]->codec, output, independent, config->palette == 1);
+        if (ret < 0) {
+            goto end;
+        }
+    }
+    // 编码器相互独立时改由差分器完成帧间差分；分段模式下各段内按顺序处理，否则需在滤镜线程之间传递参考帧
+    if (config->diff && independent) {
+        if (segment_n == 1) {
+            ret = history_alloc(&history, (FFMAX(config->queue, 1) + 1) * worker_n + 1);
+            if (ret < 0) {
+                goto end;
+            }
+        }
+        for (int i = 0; i < worker_n; i++) {
+            filter[i]->differ = differ_alloc(history);
+            if (!filter[i]->differ) {
+                ret = AVERROR(ENOMEM);
+                goto end;
+            }
+        }
+    }
+
+    // 设置滤镜结构体的其他参数
+    pts_factor = (double)output->codec->time_base.den / ((double)config->speed * input->st->time_base.den);
+    pts_interval = (double)output->codec->time_base.den / (pts_factor * config->fps);
+    sample_interval = config->adaptive ? pts_interval / ADAPTIVE_RATIO : pts_interval;    // 自适应抽帧时加密候选帧
+    for (int i = 0; i < worker_n; i++) {
+        filter[i]->id = i;
+        filter[i]->pts_factor = pts_factor;
+        filter[i]->pts_start = start_pts;
+    }
+#ifdef DEBUG
+    printf("pts_factor: %.3f; pts_interval: %.3f\n\n", pts_factor, pts_interval);
+#endif
+
+    // 两遍调色板模式：先扫描一遍生成全局调色板或各场景的调色板，第二遍各滤镜线程都只需按调色板映射颜色
+    if (config->palette > 0) {
+        ret = load_scenes(input, config, (config->start > 0) ? start_pts : \
+            ((input->st->start_time != AV_NOPTS_VALUE) ? input->st->start_time : 0), end_pts, \
+            &scenes, &scene_n, &cache_hit, &cache_miss);
+        if (ret < 0) {
+            goto end;
+        }
+        for (int i = 0; i < worker_n; i++) {
+            filter[i]->scenes = scenes;
+            ret = switch_scene(filter[i], 0);
+            if (ret < 0) {
+                goto end;
+            }
+        }
+    }
+
+    // 内存分配
+    threads = (pthread_t*)malloc(worker_n * sizeof(pthread_t));
+    if (!threads) {
+        ret = AVERROR(ENOMEM);
+        goto end;
+    }
+    mux_ctx.output = output;
+
+    if (segment_n > 1) {
+        // 为每段打开独立的输入文件，并创建存放编码结果的队列。
+        // 复用线程按段顺序取包，后面的段需要缓存至前面的段写完，因此队列容量按该段的预计帧数分配
+        seg_ctx = (SegmentThreadContext*)calloc(segment_n, sizeof(SegmentThreadContext));
+        seg_queues = (AVThreadMessageQueue**)calloc(segment_n, sizeof(AVThreadMessageQueue*));
+        if (!seg_ctx || !seg_queues) {
+            ret = AVERROR(ENOMEM);
+            goto end;
+        }
+        if (config->duration > 0) {
+            seg_frames = (int)FFMIN(config->duration * config->fps / config->speed, 1 << 20);
+        }
+        else {
+            seg_frames = (input->fmt->duration > 0) ? \
+                (int)FFMIN(input->fmt->duration / (double)AV_TIME_BASE * config->fps / config->speed, 1 << 20) : 0;
+        }
+        dec_config.thread_count = 1;    // 各段本身已经并行，段内使用单线程解码
+        for (int i = 0; i < segment_n; i++) {
+            if (i == 0) {
+                seg_ctx[i].input = input;
+            }
+            else {
+                ret = read_video(&seg_ctx[i].input, src, &dec_config);
+                if (ret < 0) {
+                    goto end;
+                }
+            }
+            ret = av_thread_message_queue_alloc(&seg_queues[i], \
+                FFMAX(seg_frames * 2 / segment_n, FFMAX(config->queue, 1)) + 16, sizeof(FrameMessage));
+            if (ret < 0) {
+                printf("Fail to create message queue.\n");
+                goto end;
+            }
+            av_thread_message_queue_set_free_func(seg_queues[i], message_free);
+            seg_ctx[i].filter = filter[i];
+            seg_ctx[i].queue = seg_queues[i];
+            seg_ctx[i].start_pts = bounds[i];
+            seg_ctx[i].end_pts = bounds[i + 1];
+            // 各段的抽帧时刻对齐到同一网格上
+            seg_ctx[i].pts_offset = (i == 0) ? start_pts : \
+                start_pts + ceil((bounds[i] - start_pts) / sample_interval) * sample_interval;
+            seg_ctx[i].pts_interval = sample_interval;
+            seg_ctx[i].scene_n = scene_n;
+            seg_ctx[i].dedup = config->dedup;
+            if (config->adaptive) {
+                seg_ctx[i].sampler = sampler_alloc(config->fps);
+                if (!seg_ctx[i].sampler) {
+                    ret = AVERROR(ENOMEM);
+                    goto end;
+                }
+            }
+        }
+        mux_ctx.queues = seg_queues;
+        mux_ctx.queue_n = segment_n;
+    }
+    else {
+        // 创建滤镜线程共享的帧队列与结果重排缓冲区
+        ret = av_thread_message_queue_alloc(&queue, FFMAX(config->queue, 1) * worker_n, sizeof(FrameMessage));
+        if (ret < 0) {
+            printf("Fail to create message queue.\n");
+            goto end;
+        }
+        av_thread_message_queue_set_free_func(queue, message_free);
+        ret = reorder_alloc(&reorder, (FFMAX(config->queue, 1) + 1) * worker_n);
+        if (ret < 0) {
+            goto end;
+        }
+        for (int i = 0; i < worker_n; i++) {
+            filter[i]->in_queue = queue;
+            filter[i]->out_buffer = reorder;
+        }
+        dec_ctx.input = input;
+        dec_ctx.queue = queue;
+        dec_ctx.reorder = reorder;
+        dec_ctx.scenes = scenes;
+        dec_ctx.scene_n = scene_n;
+        dec_ctx.pts_start = start_pts;
+        dec_ctx.pts_interval = sample_interval;
+        dec_ctx.dedup = config->dedup;
+        if (config->adaptive) {
+            dec_ctx.sampler = sampler_alloc(config->fps);
+            if (!dec_ctx.sampler) {
+                ret = AVERROR(ENOMEM);
+                goto end;
+            }
+        }
+        mux_ctx.queues = &queue;
+        mux_ctx.queue_n = 1;
+        mux_ctx.reorder = reorder;
+    }
+
+    ret = avformat_write_header(output->fmt, NULL);
+    if (ret < 0) {
+        printf("Fail to write file header.\n");
+        goto end;
+    }
+
+    // 解码-滤镜与编码-复用 三级流水线；分段模式下前两级由各分段线程完成
+    start_time = av_gettime_relative();
+    for (int i = 0; i < worker_n; i++) {
+        if (segment_n > 1) {
+            ret = pthread_create(&threads[i], NULL, segmenting, (void*)&seg_ctx[i]);
+        }
+        else {
+            ret = pthread_create(&threads[i], NULL, filting, (void*)filter[i]);
+        }
+        if (ret) {
+            ret = AVERROR(EAGAIN);
+            goto end;
+        }
+        thread_n++;
+    }
+    if (segment_n == 1) {
+        if (pthread_create(&dec_thread, NULL, decoding, (void*)&dec_ctx)) {
+            ret = AVERROR(EAGAIN);
+            goto end;
+        }
+        dec_started = 1;
+    }
+    if (pthread_create(&mux_thread, NULL, muxing, (void*)&mux_ctx)) {
+        ret = AVERROR(EAGAIN);
+        goto end;
+    }
+    mux_started = 1;
+
+    // 等待流水线结束
+    pthread_join(mux_thread, NULL);
+    mux_started = 0;
+    if (dec_started) {
+        pthread_join(dec_thread, NULL);
+        dec_started = 0;
+    }
+    elapsed = av_gettime_relative() - start_time;
+    ret = (mux_ctx.ret != AVERROR_EOF || segment_n > 1) ? mux_ctx.ret : dec_ctx.ret;
+    if (ret != AVERROR_EOF) {
+        printf("Error occurred when precessing.\n");
+        goto end;
+    }
+
+    ret = av_write_trailer(output->fmt);
+    if (ret >= 0 && stats) {
+        stats->frame_n = mux_ctx.frame_n;
+        stats->elapsed = elapsed;
+        stats->cache_hit = cache_hit;
+        stats->cache_miss = cache_miss;
+    }
+    if (ret >= 0) {
+        printf("Processed %d frames in %.2fs (%.1f fps).\n", mux_ctx.frame_n, elapsed / 1e6, \
+            elapsed > 0 ? mux_ctx.frame_n * 1e6 / elapsed : .0);
+        if (input->reduce) {
+            printf("Early downscale: 1/%d by %s.\n", 1 << input->reduce, input->lowres ? "decoder lowres" : "box filter");
+        }
+        if (segment_n == 1) {
+            printf("Decoder: %d frames in %.2fs (%.1f fps), %d thread(s), %s threading.\n", dec_ctx.decode_n, \
+                dec_ctx.decode_time / 1e6, dec_ctx.decode_time > 0 ? dec_ctx.decode_n * 1e6 / dec_ctx.decode_time : .0, \
+                input->codec->thread_count, (input->codec->active_thread_type & FF_THREAD_FRAME) ? "frame" : \
+                (input->codec->active_thread_type & FF_THREAD_SLICE) ? "slice" : "no");
+            dup_n = dec_ctx.dup_n;
+            if (dec_ctx.sampler) {
+                kept_n = dec_ctx.sampler->kept_n;
+                candidate_n = dec_ctx.sampler->candidate_n;
+            }
+        }
+        else {
+            for (int i = 0; i < segment_n; i++) {
+                dup_n += seg_ctx[i].dup_n;
+                if (seg_ctx[i].sampler) {
+                    kept_n += seg_ctx[i].sampler->kept_n;
+                    candidate_n += seg_ctx[i].sampler->candidate_n;
+                }
+            }
+        }
+        if (dup_n > 0) {
+            printf("Duplicates: %d frame(s) merged into the previous frame.\n", dup_n);
+        }
+        if (candidate_n > 0) {
+            printf("Adaptive rate: kept %d of %d candidate frames (%.1f fps on average).\n", kept_n, candidate_n, \
+                (double)kept_n * config->fps * ADAPTIVE_RATIO / candidate_n);
+        }
+        for (int i = 0; i < worker_n; i++) {
+            printf("%s %d: %d frames, %.1f%% busy.\n", (segment_n > 1) ? "Segment" : "Filter thread", i, \
+                filter[i]->frame_n, elapsed > 0 ? filter[i]->busy_time * 100.0 / elapsed : .0);
+            delta_e += filter[i]->delta_e;
+            if (filter[i]->differ) {
+                rect_area += filter[i]->differ->rect_area;
+                frame_area += filter[i]->differ->frame_area;
+                hint_area += filter[i]->differ->hint_area;
+            }
+        }
+        if (frame_area > 0) {
+            printf("Frame diff: %.1f%% of pixels encoded, %.1f%% located by motion vectors.\n", \
+                rect_area * 100.0 / frame_area, hint_area * 100.0 / frame_area);
+        }
+        if (use_quantizer(config) && mux_ctx.frame_n > 0) {
+            printf("Quantizer: sample step %d, mean dE %.2f.\n", config->sample, delta_e / mux_ctx.frame_n);
+        }
+        if (cache_hit + cache_miss > 0) {
+            printf("Palette cache: %d hit(s), %d miss(es).\n", cache_hit, cache_miss);
+        }
+    }
+
+    // 关闭消息队列，等待所有线程退出
+end:
+    if (queue) {
+        av_thread_message_queue_set_err_send(queue, AVERROR_EXIT);
+        av_thread_message_queue_set_err_recv(queue, AVERROR_EOF);
+    }
+    if (reorder) {
+        reorder_close(reorder, AVERROR_EXIT);
+    }
+    if (history) {
+        history_close(history);
+    }
+    if (seg_queues) {
+        for (int i = 0; i < segment_n; i++) {
+            if (seg_queues[i])
+                av_thread_message_queue_set_err_send(seg_queues[i], AVERROR_EXIT);
+        }
+    }
+    if (dec_started)
+        pthread_join(dec_thread, NULL);
+    if (mux_started)
+        pthread_join(mux_thread, NULL);
+    for (int i = 0; i < thread_n; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    // 释放内存
+    if (threads)
+        free(threads);
+    if (queue)
+        av_thread_message_queue_free(&queue);
+    if (reorder)
+        reorder_free(&reorder);
+    if (seg_queues) {
+        for (int i = 0; i < segment_n; i++) {
+            if (seg_queues[i])
+                av_thread_message_queue_free(&seg_queues[i]);
+        }
+        free(seg_queues);
+    }
+    if (seg_ctx) {
+        for (int i = 1; i < segment_n; i++) {
+            if (seg_ctx[i].input)
+                file_free(&seg_ctx[i].input);
+        }
+        for (int i = 0; i < segment_n; i++) {
+            sampler_free(&seg_ctx[i].sampler);
+        }
+        free(seg_ctx);
+    }
+    sampler_free(&dec_ctx.sampler);
+    if (bounds)
+        av_freep(&bounds);
+    if (input)
+        file_free(&input);
+    if (output)
+        file_free(&output);
+    for (int i = 0; i < FILTER_N; i++) {
+        if (filter_list[i])
+            free(filter_list[i]);
+    }
+    if (filter) {
+        for (int i = 0; i < worker_n; i++) {
+            if (filter[i])
+                filter_free(&filter[i]);
+        }
+        free(filter);
+    }
+    if (history)
+        history_free(&history);
+    scenes_free(&scenes, scene_n);
+
+    if (ret < 0) {
+        printf("Details: %s\n", av_err2str(ret));
+    }
+    else {
+        printf("Convertion succeed.\n");
+    }
+
+    return ret;
+}
+
+
+/**
+* 多段截取中的一个片段。
+*/
+typedef struct ClipContext {
+    float start;    // 起点（秒）
+    float end;      // 终点（秒）
+    char dst[MAX_PATH_LENGTH];
+    int64_t start_pts;
+    int64_t end_pts;
+    double pts_offset;    // 下一个抽帧时刻
+    double pts_interval;
+    FilterThreadContext* filter;    // 过滤图、编码器与输出文件在解码到片段起点时才创建，片段结束时即释放
+    FileContext* output;
+    AVThreadMessageQueue* queue;    // 送往本片段编码线程的帧，为空时由解码线程直接编码
+    pthread_t thread;
+    int opened;           // 过滤图与输出文件是否已创建
+    int started;          // 编码线程是否已启动
+    ScenePalette* scenes;
+    int scene_n;
+    int scene;            // 上一帧所属的场景，用于加快查找
+    int send_n;           // 已送往编码线程的帧数
+    int frame_n;
+    int done;
+    int ret;
+}ClipContext;
+
+
+int compare_clip(const void* a, const void* b)
+{
+    int64_t x = ((const ClipContext*)a)->start_pts, y = ((const ClipContext*)b)->start_pts;
+
+    return (x > y) - (x < y);
+}
+
+
+/**
+* 对片段的一帧完成过滤、颜色映射与编码，并写入该片段的输出文件。msg中的帧与数据包随即释放。
+*/
+void encode_clip_frame(ClipContext* clip, FrameMessage* msg)
+{
+    filter_frame(clip->filter, msg);
+    if (msg->ret >= 0) {
+        clip->ret = write_packet(clip->output, msg->packet, clip->frame_n);
+        clip->frame_n++;
+    }
+    else if (msg->ret != AVERROR(EAGAIN)) {
+        clip->ret = msg->ret;
+    }
+    message_free(msg);
+}
+
+
+/**
+* 片段的编码线程：依次取出解码线程送来的帧并编码。出错时关闭队列的发送端，解码线程随即结束该片段。
+*/
+void* clipping(void* arg)
+{
+    ClipContext* clip = (ClipContext*)arg;
+    FrameMessage msg;
+
+    while (av_thread_message_queue_recv(clip->queue, &msg, 0) >= 0) {
+        encode_clip_frame(clip, &msg);
+        if (clip->ret < 0) {
+            av_thread_message_queue_set_err_send(clip->queue, clip->ret);
+            break;
+        }
+    }
+
+    return NULL;
+}
+
+
+/**
+* 解码到片段的起点时调用：创建片段的过滤图与编码器，打开输出文件，threaded不为0时再启动编码线程。
+* 所有片段共用相同的滤镜描述，但各自拥有独立的过滤图与编码器。
+*/
+int open_clip(ClipContext* clip, int id, const FileContext* input, const ConfigureData* config, \
+    char** filter_list, int filter_n, char* filter_args, char* pal_args, int threaded)
+{
+    int ret;
+    double pts_factor;
+    enum AVPixelFormat pixel_fmt = AV_PIX_FMT_PAL8;
+
+    clip->opened = 1;
+
+    ret = create_filter(&clip->filter, filter_list, filter_n, filter_args, \
+        (config->palette > 0 && !use_mapper(config)) ? pal_args : NULL, \
+        use_mapper(config) && config->palette == 0 && !use_quantizer(config), \
+        use_mapper(config) ? AV_PIX_FMT_RGB32 : pixel_fmt);
+    if (ret >= 0) {
+        ret = attach_mapper(clip->filter, config);
+    }
+    if (ret < 0) {
+        return ret;
+    }
+    ret = write_gif(&clip->output, clip->dst, (*clip->filter->sink_filter->inputs)->w, \
+        (*clip->filter->sink_filter->inputs)->h, pixel_fmt, 1);
+    if (ret < 0) {
+        return ret;
+    }
+    clip->output->st->avg_frame_rate = (AVRational){ config->fps, 1 };
+    ret = open_encoder(&clip->filter->codec, clip->output, 0, config->palette == 1);
+    if (ret < 0) {
+        return ret;
+    }
+    pts_factor = (double)clip->output->codec->time_base.den / \
+        ((double)config->speed * input->st->time_base.den);
+    clip->pts_interval = (double)clip->output->codec->time_base.den / (pts_factor * config->fps);
+    clip->filter->id = id;
+    clip->filter->pts_factor = pts_factor;
+    clip->filter->pts_start = clip->start_pts;
+    if (clip->scenes) {
+        clip->filter->scenes = clip->scenes;
+        ret = switch_scene(clip->filter, 0);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+    ret = avformat_write_header(clip->output->fmt, NULL);
+    if (ret < 0) {
+        printf("Fail to write file header.\n");
+        return ret;
+    }
+    if (!threaded) {
+        return 0;
+    }
+
+    ret = av_thread_message_queue_alloc(&clip->queue, FFMAX(config->queue, 1), sizeof(FrameMessage));
+    if (ret < 0) {
+        return ret;
+    }
+    av_thread_message_queue_set_free_func(clip->queue, message_free);
+    if (pthread_create(&clip->thread, NULL, clipping, (void*)clip)) {
+        return AVERROR(EAGAIN);
+    }
+    clip->started = 1;
+
+    return 0;
+}
 
 
 /**
-* 从文件中读取转码配置。若文件不存在，则将配置写出至新文件。
+* 结束片段的写入：等待编码线程处理完队列中剩余的帧，写入文件尾，并释放其滤镜与输出文件。
+* err不为0时表示因出错而提前结束。
 */
-int read_config(ConfigureData* config, const char* ini_file)
+void finish_clip(ClipContext* clip, int err)
 {
-    int ret = 0;
-    FILE* fp = NULL;
+    int ret;
 
-    if (!_access(ini_file, 0)) {
-        ret = fopen_s(&fp, ini_file, "r");
-        if (fp) {
-            ret = fscanf_s(fp, "Image Scale\t=\tx%f\nPlay Speed\t=\tx%f\nFrame Rate\t=\t%d\nColor Depth\t=\t%dbit\nThread Count\t=\t%d", \
-                &config->scale, &config->speed, &config->fps, &config->depth, &config->thread);
-            ret = ret == 5 ? 0 : -1;
-            fclose(fp);
-            if (ret < 0) {
-                printf("Failed to parse configure from ini file.\n");
-                goto end;
-            }
-        }
-        else {
-            printf("Failed to open ini file.\n");
-            goto end;
+    if (clip->done) {
+        return;
+    }
+    clip->done = 1;
+    if (clip->started) {
+        av_thread_message_queue_set_err_recv(clip->queue, AVERROR_EOF);
+        pthread_join(clip->thread, NULL);
+        clip->started = 0;
+    }
+    if (err < 0 && clip->ret >= 0) {
+        clip->ret = err;
+    }
+    if (clip->ret >= 0 && !clip->output) {
+        // 解码始终没有到达该片段，不会生成输出文件
+        printf("Clip %.2fs - %.2fs is out of range.\n", clip->start, clip->end);
+        clip->ret = AVERROR_INVALIDDATA;
+    }
+    if (clip->ret >= 0 && clip->output) {
+        ret = av_write_trailer(clip->output->fmt);
+        if (ret < 0) {
+            clip->ret = ret;
         }
     }
+    if (clip->ret >= 0 && clip->filter && clip->filter->quantizer && clip->frame_n > 0) {
+        printf("Clip %.2fs - %.2fs: %d frames, mean dE %.2f.\n", clip->start, clip->end, clip->frame_n, \
+            clip->filter->delta_e / clip->frame_n);
+    }
+    else if (clip->ret >= 0) {
+        printf("Clip %.2fs - %.2fs: %d frames.\n", clip->start, clip->end, clip->frame_n);
+    }
     else {
-        ret = fopen_s(&fp, ini_file, "w");
-        if (fp) {
-            ret = fprintf(fp, "Image Scale\t=\tx%.1f\nPlay Speed\t=\tx%.1f\nFrame Rate\t=\t%d\nColor Depth\t=\t%dbit\nThread Count\t=\t%d", \
-                config->scale, config->speed, config->fps, config->depth, config->thread);
-            ret = ret > 0 ? 0 : -1;
-            fclose(fp);
-            if (ret < 0) {
-                printf("Failed to write configure to ini file.\n");
-                goto end;
-            }
-        }
-        else {
-            printf("Failed to create ini file.\n");
-            goto end;
-        }
+        printf("Clip %.2fs - %.2fs failed: %s\n", clip->start, clip->end, av_err2str(clip->ret));
     }
-#ifdef DEBUG
-    printf("Configure: scale=x%.1f,speed=x%.1f,fps=%d,depth=%dbit,thread=%d\n\n", \
-        config->scale, config->speed, config->fps, config->depth, config->thread);
-#endif
-
-end:
-    return ret;
+    if (clip->queue)
+        av_thread_message_queue_free(&clip->queue);
+    if (clip->filter)
+        filter_free(&clip->filter);
+    if (clip->output)
+        file_free(&clip->output);
+    scenes_free(&clip->scenes, clip->scene_n);
 }
 
 
 /**
-* 按照config指定的配置，将视频文件src转换为GIF格式的新文件dst。
+* 从视频文件src中一次截取多个片段，分别写入各自的GIF文件。所有片段共用一个解码器，只解封装与解码一遍，
+* 解码出的帧分发给时间范围覆盖该帧的各片段；片段之间的空档较大时直接跳转，不解码中间的部分。
+* 各片段的过滤图与输出文件只在解码到其起点时才创建，结束后立即释放，因此同时占用资源的只有时间上重叠的片段。
+* 过滤与编码由各片段的编码线程完成，同时运行的编码线程不超过Thread Count，超出的片段由解码线程直接编码。
 */
-int video2gif(const char* src, const char* dst, ConfigureData* config)
+int video2clips(const char* src, ClipContext* clips, int clip_n, ConfigureData* config, ProcessStats* stats)
 {
-    int ret = 0, t_ptr = 0, flag;
-    FileContext* input = NULL, * output = NULL;
-    FilterThreadContext** filter = NULL;
-    pthread_t* threads = NULL;
+    int ret = 0, done_n = 0, frame_n = 0, seek_n = 0, cache_hit = 0, cache_miss = 0, active_n, failed;
+    FileContext* input = NULL;
+    ClipContext* clip;
     AVPacket* packet = NULL;
-    AVFrame* frame = NULL, * frame_tmp = NULL;
-    double pts_factor;
-    double pts_offset = .0, pts_interval;
+    AVFrame* frame = NULL;
+    FrameMessage msg;
+    DecoderConfig dec_config = { config->decode_thread, config->thread_type, \
+        config->skip ? (double)config->fps * config->speed : .0, 0, config->early_scale ? config->scale : .0, \
+        config->fast };
+    int64_t base_pts, last_pts, next_pts, seek_pts = AV_NOPTS_VALUE, gap_pts;
+    int64_t start_time, elapsed;
 
     char filter_args[MAX_FILTER_LENTH] = { 0 };
+    char pal_args[MAX_FILTER_LENTH] = { 0 };
     char* filter_list[FILTER_N] = { NULL };
-    enum AVPixelFormat pixel_fmt = AV_PIX_FMT_PAL8;
+    int filter_n;
 
     // 打开输入文件
-    ret = read_video(&input, src, config->thread);
+    ret = read_video(&input, src, &dec_config);
     if (ret < 0) {
         goto end;
     }
     av_dump_format(input->fmt, input->st->index, src, 0);
     printf("\n");
+    if (config->dedup || config->adaptive || config->diff) {
+        printf("Drop Duplicates, Adaptive Rate and Frame Diff are ignored for clip jobs.\n\n");
+    }
 
-    // 设置滤镜输入端参数
-    snprintf(filter_args, sizeof(filter_args), \
-        "video_size=%dx%d:pix_fmt=%d:time_base=%d/%d:pixel_aspect=%d/%d", \
-        input->codec->width, input->codec->height, input->codec->pix_fmt, input->st->time_base.num, \
-        input->st->time_base.den, input->st->sample_aspect_ratio.num, input->st->sample_aspect_ratio.den);
-#ifdef DEBUG
-    printf("\nFilter Input:\n%s\n", filter_args);
-#endif
+    // 换算各片段的时间范围，并按起点排序
+    base_pts = (input->st->start_time != AV_NOPTS_VALUE) ? input->st->start_time : 0;
+    gap_pts = av_rescale_q((int64_t)CLIP_SEEK_GAP * AV_TIME_BASE, AV_TIME_BASE_Q, input->st->time_base);
+    input->end_pts = 0;
+    for (int i = 0; i < clip_n; i++) {
+        clips[i].start_pts = base_pts + \
+            av_rescale_q((int64_t)(clips[i].start * AV_TIME_BASE), AV_TIME_BASE_Q, input->st->time_base);
+        clips[i].end_pts = base_pts + \
+            av_rescale_q((int64_t)(clips[i].end * AV_TIME_BASE), AV_TIME_BASE_Q, input->st->time_base);
+        clips[i].pts_offset = clips[i].start_pts;
+        input->end_pts = FFMAX(input->end_pts, clips[i].end_pts);
+    }
+    qsort(clips, clip_n, sizeof(ClipContext), compare_clip);
 
-    // 设置滤镜的描述字符串
     for (int i = 0; i < FILTER_N; i++) {
         filter_list[i] = (char*)malloc(MAX_FILTER_LENTH * sizeof(char));
         if (!filter_list[i]) {
@@ -538,160 +5875,154 @@ int video2gif(const char* src, const char* dst, ConfigureData* config)
             goto end;
         }
     }
-    snprintf(filter_list[0], MAX_FILTER_LENTH, "[in]scale=%.0f:-1,split[split1][split2]", \
-        (double)config->scale * input->codec->width);
-    snprintf(filter_list[1], MAX_FILTER_LENTH, "[split1]palettegen=max_colors=%d:stats_mode=single[pal]", \
-        (config->depth >= 8)?256:256>>(8 - config->depth));
-    snprintf(filter_list[2], MAX_FILTER_LENTH, "[split2][pal]paletteuse=new=%d[out]", \
-        (config->thread == 1) ? 0 : 1);
-#ifdef DEBUG
-    printf("\nFliter String:\n");
-    for (int i = 0; i < FILTER_N; i++)
-        printf("%s\n", filter_list[i]);
-#endif
-
-    // 创建滤镜
-    filter = (FilterThreadContext**)calloc(config->thread, sizeof(FilterThreadContext*));
-    if (!filter) {
-        ret = AVERROR(ENOMEM);
-        goto end;
-    }
-    for (int i = 0; i < config->thread; i++) {
-        ret = create_filter(&filter[i], filter_list, FILTER_N, filter_args, pixel_fmt);
+    filter_n = format_filters(filter_args, pal_args, sizeof(filter_args), filter_list, input, config, config->thread > 1);
+    if (config->palette > 0) {
+        // 每个片段各自扫描生成调色板，调色板很小，可以预先全部生成
+        for (int i = 0; i < clip_n; i++) {
+            ret = load_scenes(input, config, clips[i].start_pts, clips[i].end_pts, \
+                &clips[i].scenes, &clips[i].scene_n, &cache_hit, &cache_miss);
+            if (ret < 0) {
+                goto end;
+            }
+        }
+        ret = seek_video(input, base_pts);
         if (ret < 0) {
             goto end;
         }
     }
-#ifdef DEBUG
-    printf("\nFilter Graph:\n%s\n", avfilter_graph_dump(filter[0]->graph, NULL));
-#endif
-    
-    // 打开输出文件
-    ret = write_gif(&output, dst, (*filter[0]->sink_filter->inputs)->w, (*filter[0]->sink_filter->inputs)->h, \
-        pixel_fmt, config->thread);
-    if (ret < 0) {
-        goto end;
-    }
-    output->st->avg_frame_rate = (AVRational){ config->fps, 1 };
-    av_dump_format(output->fmt, 0, dst, 1);
-    printf("\n");
-
-    // 设置滤镜结构体的其他参数
-    pts_factor = (double)output->codec->time_base.den / ((double)config->speed * input->st->time_base.den);
-    for (int i = 0; i < config->thread; i++) {
-        filter[i]->id = i;
-        filter[i]->pts_factor = pts_factor;
-        *filter[i]->flag = AVERROR(EAGAIN);
-    }
 
-    // 内存分配
     packet = av_packet_alloc();
     frame = av_frame_alloc();
-    frame_tmp = av_frame_alloc();
-    if (!packet || !frame || !frame_tmp) {
-        ret = AVERROR(ENOMEM);
-        goto end;
-    }
-    threads = (pthread_t*)malloc(config->thread * sizeof(pthread_t));
-    if (!threads) {
+    if (!packet || !frame) {
         ret = AVERROR(ENOMEM);
         goto end;
     }
 
-    // 创建滤镜线程
-    for (int i = 0; i < config->thread; i++) {
-        pthread_create(&threads[i], NULL, filting, (void*)filter[i]);
-    }
-
-    ret = avformat_write_header(output->fmt, NULL);
+    start_time = av_gettime_relative();
+    last_pts = base_pts;
+    while (done_n < clip_n) {
+        // 尚未开始的片段中最近的一个离当前位置较远时，直接跳转到其起点。同一位置只跳转一次，
+        // 以免关键帧间隔大于空档时反复跳回
+        next_pts = INT64_MAX;
+        for (int i = 0; i < clip_n; i++) {
+            if (!clips[i].done) {
+                next_pts = FFMIN(next_pts, clips[i].start_pts);
+            }
+        }
+        if (next_pts - last_pts > gap_pts && next_pts != seek_pts) {
+            ret = seek_video(input, next_pts);
+            if (ret < 0) {
+                break;
+            }
+            seek_pts = next_pts;
+            seek_n++;
+        }
 
-    // 解码-滤镜-编码 主循环
-    pts_interval = (double)output->codec->time_base.den / (pts_factor * config->fps);
-#ifdef DEBUG
-    printf("pts_factor: %.3f; pts_offset: %.3f; pts_interval: %.3f\n\n", pts_factor, pts_offset, pts_interval);
-#endif
-    do {
         ret = decode(input, frame, packet);
-        if (ret < 0 && ret != AVERROR_EOF) break;
-        while (*filter[t_ptr]->flag == 1) {
-            Sleep(WAIT_TIME);
+        if (ret < 0) {
+            break;
         }
-        flag = *filter[t_ptr]->flag;
-        if (ret >= 0) {
-            if (flag != -1) {
-                if (frame->pts >= pts_offset) {
-                    av_frame_move_ref(frame_tmp, filter[t_ptr]->frame);
-                    av_frame_move_ref(filter[t_ptr]->frame, frame);
-                    av_frame_move_ref(frame, frame_tmp);
-#ifdef DEBUG
-                    printf("Exchange frame with thread-%d\n", t_ptr);
-#endif
-                    *filter[t_ptr]->flag = 1;    // 通知线程进行帧处理
-                    if (flag == 0) {
-                        ret = encode(output, frame, packet);
-                    }
-                    pts_offset += pts_interval;
+        if (frame->pts == AV_NOPTS_VALUE) {
+            continue;
+        }
+        last_pts = frame->pts;
+
+        // 将帧分发给覆盖该时刻的各片段，解码到片段起点时才打开该片段
+        for (int i = 0; i < clip_n; i++) {
+            clip = &clips[i];
+            if (clip->done) {
+                continue;
+            }
+            if (frame->pts >= clip->end_pts) {
+                finish_clip(clip, 0);
+                done_n++;
+                continue;
+            }
+            if (frame->pts < clip->pts_offset) {
+                continue;
+            }
+            if (!clip->opened) {
+                active_n = 0;
+                for (int j = 0; j < clip_n; j++) {
+                    active_n += clips[j].started;
                 }
-                else {
+                clip->ret = open_clip(clip, i, input, config, filter_list, filter_n, filter_args, pal_args, \
+                    active_n < FFMAX(config->thread, 1));
+                if (clip->ret < 0) {
+                    finish_clip(clip, 0);
+                    done_n++;
                     continue;
                 }
             }
-        }
-        else {
-            if (flag != -1) {
-                *filter[t_ptr]->flag = -1;    // 标记滤镜为已关闭
-                if (flag == 0) {
-                    av_frame_unref(frame);
-                    av_frame_move_ref(frame, filter[t_ptr]->frame);
-                    ret = encode(output, frame, packet);
-                }
+            msg.frame = av_frame_clone(frame);
+            if (!msg.frame) {
+                ret = AVERROR(ENOMEM);
+                break;
+            }
+            msg.packet = NULL;
+            msg.seq = clip->send_n;
+            msg.scene = clip->scenes ? find_scene(clip->scenes, clip->scene_n, frame->pts, clip->scene) : 0;
+            clip->scene = msg.scene;
+            if (clip->queue) {
+                failed = av_thread_message_queue_send(clip->queue, &msg, 0) < 0;    // 编码线程已出错退出
+                if (failed)
+                    message_free(&msg);
             }
             else {
-                ret = encode(output, NULL, packet);
+                encode_clip_frame(clip, &msg);
+                failed = clip->ret < 0;
+            }
+            if (failed) {
+                finish_clip(clip, 0);
+                done_n++;
+                continue;
             }
+            clip->send_n++;
+            clip->pts_offset += clip->pts_interval;
         }
-        // 线程指针循环
-        if (t_ptr < config->thread - 1) {
-            t_ptr++;
+        if (ret < 0) {
+            break;
         }
-        else {
-            t_ptr = 0;
+    }
+    if (ret >= 0 || ret == AVERROR_EOF) {
+        ret = 0;
+        // 等待各片段写完剩余的帧后再统计
+        for (int i = 0; i < clip_n; i++) {
+            finish_clip(&clips[i], 0);
+            frame_n += clips[i].frame_n;
+        }
+        elapsed = av_gettime_relative() - start_time;
+        printf("Processed %d clips, %d frames in %.2fs (%.1f fps), %d seek(s).\n", clip_n, frame_n, \
+            elapsed / 1e6, elapsed > 0 ? frame_n * 1e6 / elapsed : .0, seek_n);
+        if (cache_hit + cache_miss > 0) {
+            printf("Palette cache: %d hit(s), %d miss(es).\n", cache_hit, cache_miss);
+        }
+        if (stats) {
+            stats->frame_n = frame_n;
+            stats->elapsed = elapsed;
+            stats->cache_hit = cache_hit;
+            stats->cache_miss = cache_miss;
         }
-    } while (ret >= 0 || ret == AVERROR(EAGAIN));
-    if (ret != AVERROR_EOF) {
-        for (int i = 0; i < config->thread; i++)
-            *filter[i]->flag = -1;
-        printf("Error occurred when precessing.\n");
-        goto end;
     }
 
-    ret = av_write_trailer(output->fmt);
-
-    // 释放内存
 end:
+    // 出错时结束剩余的片段
+    for (int i = 0; i < clip_n; i++) {
+        finish_clip(&clips[i], ret);
+        if (clips[i].ret < 0 && ret >= 0) {
+            ret = clips[i].ret;
+        }
+    }
     if (packet)
         av_packet_free(&packet);
     if (frame)
         av_frame_free(&frame);
-    if (frame_tmp)
-        av_frame_free(&frame_tmp);
-    if (threads)
-        free(threads);
     if (input)
         file_free(&input);
-    if (output)
-        file_free(&output);
     for (int i = 0; i < FILTER_N; i++) {
         if (filter_list[i])
             free(filter_list[i]);
     }
-    if (filter) {
-        for (int i = 0; i < config->thread; i++) {
-            if (filter[i])
-                filter_free(&filter[i]);
-        }
-        free(filter);
-    }
 
     if (ret < 0) {
         printf("Details: %s\n", av_err2str(ret));
@@ -704,6 +6035,138 @@ end:
 }
 
 
+/**
+* 批处理中的一项转码任务。
+*/
+typedef struct BatchJob {
+    int id;
+    char src[MAX_PATH_LENGTH];
+    char dst[MAX_PATH_LENGTH];
+    int64_t size;    // 源文件大小，用于调度排序
+    ClipContext* clips;    // 多段截取任务的片段列表，为空时表示普通转码任务
+    int clip_n;
+    ProcessStats stats;
+    int ret;
+}BatchJob;
+
+
+/**
+* 执行一项转码任务。
+*/
+int run_job(BatchJob* job, ConfigureData* config)
+{
+    if (job->clips) {
+        return video2clips(job->src, job->clips, job->clip_n, config, &job->stats);
+    }
+
+    return video2gif(job->src, job->dst, config, &job->stats);
+}
+
+
+/**
+* 批处理调度结构体。各工作线程从任务列表中依次领取下一项任务。
+*/
+typedef struct BatchContext {
+    BatchJob* jobs;
+    int job_n;
+    int next;
+    ConfigureData config;    // 按线程预算分配后的单个任务配置
+    pthread_mutex_t mutex;
+}BatchContext;
+
+
+int compare_job(const void* a, const void* b)
+{
+    int64_t x = ((const BatchJob*)a)->size, y = ((const BatchJob*)b)->size;
+
+    return (x < y) - (x > y);    // 从大到小
+}
+
+
+void* batching(void* arg)
+{
+    BatchContext* ctx = (BatchContext*)arg;
+    ConfigureData config;
+    BatchJob* job;
+
+    while (1) {
+        pthread_mutex_lock(&ctx->mutex);
+        job = (ctx->next < ctx->job_n) ? &ctx->jobs[ctx->next++] : NULL;
+        pthread_mutex_unlock(&ctx->mutex);
+        if (!job) {
+            break;
+        }
+        printf("Job %d started. (%s)\n", job->id, job->src);
+        config = ctx->config;
+        job->ret = run_job(job, &config);
+        printf("Job %d %s.\n\n", job->id, (job->ret < 0) ? "failed" : "finished");
+    }
+
+    return NULL;
+}
+
+
+/**
+* 同时运行多个转码任务。Thread Count作为全局线程预算，平均分给各任务，任务内部再分为滤镜线程与解码线程；
+* 任务按文件从大到小的顺序领取，使耗时最长的任务最先开始，以缩短总用时。
+*/
+int run_batch(BatchJob* jobs, int job_n, const ConfigureData* config)
+{
+    int ret = 0, worker_n, thread_n = 0, share;
+    BatchContext ctx;
+    pthread_t* threads = NULL;
+
+    // 每个任务至少需要一个滤镜线程与一个解码线程，预算不足时减少同时运行的任务数
+    worker_n = FFMIN(FFMIN(FFMAX(config->batch, 1), job_n), FFMAX(config->thread / 2, 1));
+    share = FFMAX(config->thread / worker_n, 1);
+    ctx.jobs = jobs;
+    ctx.job_n = job_n;
+    ctx.next = 0;
+    ctx.config = *config;
+    if (ctx.config.decode_thread <= 0) {
+        ctx.config.thread = FFMAX(share * 3 / 4, 1);
+        ctx.config.decode_thread = FFMAX(share - ctx.config.thread, 1);    // 自动模式下解码线程同样受总预算约束
+    }
+    else {
+        ctx.config.decode_thread = FFMIN(ctx.config.decode_thread, FFMAX(share - 1, 1));
+        ctx.config.thread = FFMAX(share - ctx.config.decode_thread, 1);
+    }
+    // 误差扩散的线程由每个滤镜线程各自占用，相应减少滤镜线程
+    if (ctx.config.dither_thread > 1) {
+        ctx.config.dither_thread = FFMIN(ctx.config.dither_thread, FFMAX(share - ctx.config.decode_thread, 1));
+        ctx.config.thread = FFMAX((share - ctx.config.decode_thread) / ctx.config.dither_thread, 1);
+    }
+    // 分段时每段各有一个单线程解码器与一个滤镜线程；多段截取的编码线程数已由thread限制
+    ctx.config.segment = FFMIN(ctx.config.segment, FFMAX(share / (FFMAX(ctx.config.dither_thread, 1) + 1), 1));
+    printf("Running %d jobs at a time, %d filter thread(s) and %d decoder thread(s) per job.\n\n", \
+        worker_n, ctx.config.thread, ctx.config.decode_thread);
+    qsort(jobs, job_n, sizeof(BatchJob), compare_job);
+
+    threads = (pthread_t*)malloc(worker_n * sizeof(pthread_t));
+    if (!threads) {
+        return AVERROR(ENOMEM);
+    }
+    pthread_mutex_init(&ctx.mutex, NULL);
+    for (int i = 0; i < worker_n; i++) {
+        if (pthread_create(&threads[i], NULL, batching, (void*)&ctx)) {
+            ret = AVERROR(EAGAIN);
+            break;
+        }
+        thread_n++;
+    }
+    if (!thread_n) {
+        batching((void*)&ctx);    // 无法创建线程时退化为串行执行
+    }
+    for (int i = 0; i < thread_n; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    pthread_mutex_destroy(&ctx.mutex);
+    free(threads);
+
+    return ret;
+}
+
+
 /**
 * 设置窗口标题，同时将工作路径修改为程序所在的文件夹。
 */
@@ -759,18 +6222,156 @@ int A2U(const char* ansiiCode, char* utf8Code)
 }
 
 
+/**
+* 读取多段截取的任务文件。第一行为源视频路径，之后每行描述一个片段，格式为“起点(秒) 终点(秒) 输出路径”，
+* 以#开头的行为注释，相对路径均相对于任务文件所在的文件夹。src返回源视频路径，clips使用结束后需要调用free释放。
+*/
+int read_clips(const char* filename, char* src, ClipContext** clips, int* clip_n)
+{
+    int ret = 0, size = 0;
+    FILE* fp = NULL;
+    char line[MAX_PATH_LENGTH], path[MAX_PATH_LENGTH], dir[MAX_PATH_LENGTH], full_path[MAX_PATH_LENGTH];
+    char* sep;
+    float start, end;
+    ClipContext* list = NULL, * clip;
+
+    *clips = NULL;
+    *clip_n = 0;
+    src[0] = '\0';
+    strcpy_s(dir, MAX_PATH_LENGTH, filename);
+    sep = FFMAX(strrchr(dir, '\\'), strrchr(dir, '/'));
+    if (sep)
+        sep[1] = '\0';
+    else
+        dir[0] = '\0';
+
+    ret = fopen_s(&fp, filename, "r");
+    if (!fp) {
+        printf("Failed to open clip file. (%s)\n", filename);
+        return -1;
+    }
+    while (fgets(line, sizeof(line), fp)) {
+        line[strcspn(line, "\r\n")] = '\0';
+        if (line[0] == '\0' || line[0] == '#') {
+            continue;
+        }
+        if (!src[0]) {
+            join_path(src, dir, line);
+            continue;
+        }
+        if (sscanf(line, "%f %f %[^\n]", &start, &end, path) != 3 || start < 0 || end <= start) {
+            printf("Invalid clip: %s\n", line);
+            ret = -1;
+            break;
+        }
+        if (*clip_n >= size) {
+            size = size ? size * 2 : 8;
+            clip = (ClipContext*)realloc(list, size * sizeof(ClipContext));
+            if (!clip) {
+                ret = AVERROR(ENOMEM);
+                break;
+            }
+            list = clip;
+        }
+        clip = &list[(*clip_n)++];
+        memset(clip, 0, sizeof(ClipContext));
+        clip->start = start;
+        clip->end = end;
+        join_path(full_path, dir, path);
+        A2U(full_path, clip->dst);
+    }
+    fclose(fp);
+    if (ret >= 0 && (!src[0] || !*clip_n)) {
+        printf("No clip is found in clip file. (%s)\n", filename);
+        ret = -1;
+    }
+    if (ret < 0) {
+        free(list);
+        *clip_n = 0;
+        return ret;
+    }
+    *clips = list;
+
+    return 0;
+}
+
+
+#ifdef BENCHMARK
+/**
+* 按当前配置分别以1、4、8个线程转码视频文件path，比较整条流水线的吞吐量。关闭调色板缓存，避免后几次直接命中缓存。
+*/
+void benchmark_pipeline(const char* path, const ConfigureData* config)
+{
+    const int threads[3] = { 1, 4, 8 };
+    char src[MAX_PATH_LENGTH], dst[MAX_PATH_LENGTH];
+    ConfigureData bench = *config;
+    ProcessStats stats;
+
+    A2U(path, src);
+    A2U(gif_path(path), dst);
+    bench.cache = 0;
+    printf("Pipeline benchmark:\n");
+    for (int i = 0; i < 3; i++) {
+        bench.thread = threads[i];
+        memset(&stats, 0, sizeof(ProcessStats));
+        if (video2gif(src, dst, &bench, &stats) < 0) {
+            printf("  %d thread(s)  failed\n", threads[i]);
+            continue;
+        }
+        printf("  %d thread(s)  %d frames in %.2fs (%.1f fps)\n", threads[i], stats.frame_n, stats.elapsed / 1e6, \
+            stats.elapsed > 0 ? stats.frame_n * 1e6 / stats.elapsed : .0);
+    }
+}
+#endif
+
+
 int main(int argc, char** argv)
 {
-    int ret = 0;
-    char srcPath[MAX_PATH_LENGTH], dstPath[MAX_PATH_LENGTH];
+    int ret = 0, job_n = 0, done_n = 0, frame_n = 0, cache_hit = 0, cache_miss = 0;
+    BatchJob* jobs = NULL;
+    char src_path[MAX_PATH_LENGTH], * suffix;
+    struct _stati64 file_stat;
+    int64_t start_time, elapsed;
     ConfigureData config = {
         .scale = 1.0,
         .speed = 1.0,
         .fps = 10,
         .depth = 8,
-        .thread = 1
+        .thread = 1,
+        .queue = 2,
+        .segment = 0,
+        .batch = 1,
+        .decode_thread = 0,
+        .thread_type = 0,
+        .skip = 1,
+        .start = 0,
+        .duration = 0,
+        .palette = 0,
+        .cache = 1,
+        .mapper = 0,
+        .quantizer = 0,
+        .sample = 2,
+        .direct = 0,
+        .dither = DITHER_SIERRA,
+        .bayer_scale = 2,
+        .dither_thread = 1,
+        .diff = 0,
+        .dedup = 0,
+        .mvs = 0,
+        .adaptive = 0,
+        .early_scale = 1,
+        .fast = 0
     };
     
+#ifdef BENCHMARK
+    benchmark_mapper();
+    benchmark_direct();
+    if (argc > 1) {
+        A2U(argv[1], src_path);
+        benchmark_decode(src_path);
+        benchmark_decode_threads(src_path);
+    }
+#endif
     set_default_path();
     
     if (argc <= 1) {
@@ -782,25 +6383,81 @@ int main(int argc, char** argv)
     if (ret != 0) {
         goto end;
     }
-    
+#ifdef BENCHMARK
+    benchmark_pipeline(argv[1], &config);
+#endif
+
+    // 收集待转码的文件
+    jobs = (BatchJob*)calloc(argc - 1, sizeof(BatchJob));
+    if (!jobs) {
+        printf("Fail to allocate memory.\n");
+        goto end;
+    }
     for (int i = 1; i < argc; i++) {
-        printf("%d\n------------------------------------------------------------\n", i);
         if (!_access(argv[i], 4)) {
-            A2U(argv[i], srcPath);
-            A2U(gif_path(argv[i]), dstPath);
-            ret = video2gif(srcPath, dstPath, &config);
+            jobs[job_n].id = i;
+            suffix = strrchr(argv[i], '.');
+            if (suffix && !_stricmp(suffix, ".txt")) {
+                // 多段截取的任务文件
+                if (read_clips(argv[i], src_path, &jobs[job_n].clips, &jobs[job_n].clip_n) < 0) {
+                    continue;
+                }
+                A2U(src_path, jobs[job_n].src);
+                jobs[job_n].size = _stati64(src_path, &file_stat) ? 0 : file_stat.st_size;
+            }
+            else {
+                A2U(argv[i], jobs[job_n].src);
+                A2U(gif_path(argv[i]), jobs[job_n].dst);
+                jobs[job_n].size = _stati64(argv[i], &file_stat) ? 0 : file_stat.st_size;
+            }
+            job_n++;
         }
         else {
             printf("File doesn't exist or access denied. (%s)\n", argv[i]);
         }
-        printf("\n\n");
+    }
+
+    start_time = av_gettime_relative();
+    if (config.batch > 1 && job_n > 1) {
+        run_batch(jobs, job_n, &config);
+    }
+    else {
+        for (int i = 0; i < job_n; i++) {
+            printf("%d\n------------------------------------------------------------\n", jobs[i].id);
+            jobs[i].ret = run_job(&jobs[i], &config);
+            printf("\n\n");
+        }
+    }
+    elapsed = av_gettime_relative() - start_time;
+
+    // 汇总吞吐量
+    if (job_n > 1) {
+        for (int i = 0; i < job_n; i++) {
+            if (jobs[i].ret >= 0) {
+                done_n++;
+                frame_n += jobs[i].stats.frame_n;
+                cache_hit += jobs[i].stats.cache_hit;
+                cache_miss += jobs[i].stats.cache_miss;
+            }
+        }
+        printf("Batch: %d/%d files, %d frames in %.2fs (%.2f files/s, %.1f frames/s).\n", \
+            done_n, job_n, frame_n, elapsed / 1e6, elapsed > 0 ? done_n * 1e6 / elapsed : .0, \
+            elapsed > 0 ? frame_n * 1e6 / elapsed : .0);
+        if (cache_hit + cache_miss > 0) {
+            printf("Palette cache: %d hit(s), %d miss(es).\n", cache_hit, cache_miss);
+        }
     }
 
 end:
+    if (jobs) {
+        for (int i = 0; i < job_n; i++) {
+            if (jobs[i].clips)
+                free(jobs[i].clips);
+        }
+        free(jobs);
+    }
     printf("\n\n");
     system("pause");
 
     return 0;
 }
-
-